@@ -1,29 +1,890 @@
+#include "contiki.h"
 #include "commons.h"
 #include <string.h>
+#include "net/netstack.h"
+#include "net/nullnet/nullnet.h"
+#include "net/packetbuf.h"
+#include "lib/random.h"
+#include "lib/list.h"
+#include "lib/memb.h"
+#include "lib/trickle-timer.h"
+#include "sys/energest.h"
 
 
-m_packet_t encode_message(m_rank_t rank, m_msgcat_t msgcat) {
+static m_rank_t node_rank;
+static uint8_t node_depth = DEPTH_UNKNOWN;
+static const m_addr_table_t *node_children;
+static uint8_t next_seq;
+
+static struct trickle_timer hello_timer;
+static clock_time_t last_hello;
+static clock_time_t last_traffic;
+static uint8_t hello_skips;
+static uint8_t node_cats;
+static uint8_t advertised_cats;
+static uint8_t child_cats[CHILDREN_TABLE_SIZE];
+static uint8_t child_sleepy[CHILDREN_TABLE_SIZE];
+
+typedef struct m_tx_entry {
+    struct m_tx_entry *next;
+    linkaddr_t dest; /* null address for broadcasts */
+    uint8_t msgcat;
+    uint8_t class;
+    uint8_t forwarded;
+    uint8_t len;
+    uint8_t residence; /* offset of the trace residence, 0 if untraced */
+    clock_time_t queued;
+    uint8_t frame[PKT_MAX_LEN];
+} m_tx_entry_t;
+
+MEMB(tx_pool, m_tx_entry_t, TX_QUEUE_SIZE);
+LIST(tx_control);
+LIST(tx_app);
+static uint8_t tx_pending;
+static uint8_t tx_queued;
+static uint8_t tx_queue_peak;
+static uint16_t tx_queue_drops;
+
+static uint8_t node_sleepy;
+static struct ctimer sleep_timer;
+
+typedef struct m_queued {
+    uint8_t used;
+    linkaddr_t child;
+    clock_time_t queued_at;
+    m_packet_t packet;
+} m_queued_t;
+
+static m_queued_t sleepy_queue[SLEEPY_QUEUE_SIZE];
+static uint16_t sleepy_queue_drops;
+
+typedef struct m_acct {
+    uint8_t tx_frames;
+    uint8_t rx_frames;
+    uint16_t tx_bytes;
+    uint16_t rx_bytes;
+    uint32_t tx_time; /* Energest ticks */
+    uint32_t rx_time;
+} m_acct_t;
+
+static m_acct_t acct[ACCT_CLASSES];
+static m_acct_t acct_report[ACCT_CLASSES];
+static uint64_t acct_last_transmit;
+static uint8_t energy_buf[ENERGY_PAYLOAD_MAX];
+static uint16_t stats[NB_MSGCAT][NB_STATS];
+static uint8_t stats_buf[STATS_PAYLOAD_MAX];
+static int16_t duty_cycle[3]; /* CPU, listen, transmit */
+static uint64_t duty_last[4]; /* total, CPU, listen, transmit */
+
+typedef struct m_link {
+    int16_t rssi;  /* dBm * LINK_SCALE */
+    uint16_t etx;  /* transmissions * LINK_SCALE */
+    uint8_t rank;
+    uint8_t depth;
+    uint8_t load;
+    uint8_t samples;
+} m_link_t;
+
+ADDR_TABLE(neighbors, NEIGHBOR_TABLE_SIZE, NEIGHBOR_TIMEOUT);
+static m_link_t links[NEIGHBOR_TABLE_SIZE];
+static uint16_t parent_changes;
+
+ADDR_TABLE(routes, ROUTES_TABLE_SIZE, ROUTE_TIMEOUT);
+static uint8_t route_next_hop[ROUTES_TABLE_SIZE];
+
+typedef struct m_seen {
+    linkaddr_t origin;
+    uint8_t seq;
+} m_seen_t;
+
+static m_seen_t dup_cache[DUP_CACHE_SIZE];
+static int dup_cache_len;
+static int dup_cache_next;
+static uint16_t dup_suppressed;
+
+#if FLOOD_REPAIR
+// one per flood awaiting its repair, keyed by (origin, seq)
+typedef struct m_flood {
+    m_packet_t packet;
+    const m_addr_table_t *children;
+    uint8_t unconfirmed[CHILDREN_TABLE_SIZE];
+    uint8_t used;
+    clock_time_t sent_at;
+    struct ctimer timer;
+} m_flood_t;
+
+static m_flood_t floods[FLOOD_REPAIR_SLOTS];
+#endif
+
+static void log_duty_cycle(void) {
+  energest_flush();
+  uint64_t now[4] = {
+    ENERGEST_GET_TOTAL_TIME(),
+    energest_type_time(ENERGEST_TYPE_CPU),
+    energest_type_time(ENERGEST_TYPE_LISTEN),
+    energest_type_time(ENERGEST_TYPE_TRANSMIT),
+  };
+  uint64_t elapsed = now[0] - duty_last[0];
+  for (int i = 0; i < 3; i++) {
+    // in hundredths of a percent
+    duty_cycle[i] = elapsed > 0 ? (now[i + 1] - duty_last[i + 1]) * 10000 / elapsed : 0;
+  }
+  memcpy(duty_last, now, sizeof(duty_last));
+  LOG_INFO("Radio duty cycle: listen %d.%02d%%, transmit %d.%02d%%\n",
+    duty_cycle[1] / 100, duty_cycle[1] % 100, duty_cycle[2] / 100, duty_cycle[2] % 100);
+}
+
+void init_commons(m_rank_t rank, const m_addr_table_t *children) {
+  node_rank = rank;
+  node_children = children;
+  if (rank == GATEWAY)
+    node_depth = 0;
+  next_seq = random_rand();
+  // the first frame is charged only its own transmit time
+  energest_flush();
+  acct_last_transmit = energest_type_time(ENERGEST_TYPE_TRANSMIT);
+  memb_init(&tx_pool);
+  list_init(tx_control);
+  list_init(tx_app);
+}
+
+m_packet_t new_message(m_rank_t rank, m_msgcat_t msgcat) {
   m_packet_t packet = {
     .rank = rank,
     .msgcat = msgcat,
     .appcat = NULL_APP,
     .value = 0,
+    .flags = 0,
+    .depth = 0,
+    .load = 0,
+    .cats = 0,
     .src={{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }},
+    .dst={{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }},
+    .payload = NULL,
+    .payload_len = 0,
   };
   return packet;
 }
 
-m_packet_t encode_app_message(m_rank_t rank, m_appcat_t appcat, int value)   {
+m_packet_t new_app_message(m_rank_t rank, m_appcat_t appcat, int value)   {
   m_packet_t packet = {
     .rank = rank,
     .msgcat = APPLICATION,
     .appcat = appcat,
     .value = value,
+    .flags = 0,
+    .depth = 0,
+    .load = 0,
     .src={{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }},
+    .dst={{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }},
+    .payload = NULL,
+    .payload_len = 0,
   };
   return packet;
 }
 
+void set_packet_src(m_packet_t *packet, const linkaddr_t *src) {
+  linkaddr_copy(&packet->src, src);
+  packet->flags |= PKT_FLAG_SRC;
+}
+
+void set_packet_dst(m_packet_t *packet, const linkaddr_t *dst) {
+  linkaddr_copy(&packet->dst, dst);
+  packet->flags |= PKT_FLAG_DST;
+}
+
+void set_packet_origin(m_packet_t *packet) {
+  set_packet_src(packet, &linkaddr_node_addr);
+  packet->seq = next_seq++;
+  packet->flags |= PKT_FLAG_SEQ;
+}
+
+void set_packet_payload(m_packet_t *packet, const uint8_t *payload, uint8_t len) {
+  packet->payload = payload;
+  packet->payload_len = len;
+  packet->flags |= PKT_FLAG_PAYLOAD;
+}
+
+static void put_int16(uint8_t *buf, int value) {
+  buf[0] = (uint16_t) value & 0xff;
+  buf[1] = (uint16_t) value >> 8;
+}
+
+static int get_int16(const uint8_t *buf) {
+  return (int16_t) (buf[0] | (buf[1] << 8));
+}
+
+static uint32_t clock_ms(clock_time_t ticks) {
+  return (uint64_t)ticks * 1000 / CLOCK_SECOND;
+}
+
+void set_packet_trace(m_packet_t *packet) {
+#if LATENCY_TRACE
+  packet->received = clock_time();
+  packet->trace.origin = clock_ms(packet->received);
+  packet->trace.hops = 0;
+  packet->trace.residence = 0;
+  packet->flags |= PKT_FLAG_TRACE;
+#endif
+}
+
+// adds the time since the packet got here, call just before sending it on
+void trace_forward(m_packet_t *packet) {
+  if (!(packet->flags & PKT_FLAG_TRACE))
+    return;
+  clock_time_t now = clock_time();
+  uint32_t residence = packet->trace.residence + clock_ms(now - packet->received);
+  packet->trace.residence = residence > 0xffff ? 0xffff : residence;
+  if (packet->trace.hops < 0xff)
+    packet->trace.hops++;
+  packet->received = now;
+}
+
+// estimated ms from the origin to here, -1 without a trace
+int trace_latency(const m_packet_t *packet) {
+  if (!(packet->flags & PKT_FLAG_TRACE))
+    return -1;
+  uint32_t latency = packet->trace.residence + clock_ms(clock_time() - packet->received)
+    + (packet->trace.hops + 1) * TRACE_HOP_MS;
+  return latency > 0x7fff ? 0x7fff : latency;
+}
+
+int batch_add(m_batch_t *batch, const m_packet_t *reading) {
+  if (batch->count == BATCH_MAX_RECORDS)
+    return -1;
+
+  int value = reading->value;
+  uint8_t *record = &batch->records[batch->count * BATCH_RECORD_LEN];
+  memcpy(record, reading->src.u8, LINKADDR_SIZE);
+  put_int16(&record[LINKADDR_SIZE], value);
+  if (batch->count == 0 && reading->flags & PKT_FLAG_TRACE) {
+    batch->traced = 1;
+    batch->trace = reading->trace;
+    batch->received = reading->received;
+  }
+
+  if (batch->count == 0 || value < batch->min)
+    batch->min = value;
+  if (batch->count == 0 || value > batch->max)
+    batch->max = value;
+  batch->sum += value;
+
+  return ++batch->count;
+}
+
+m_packet_t batch_packet(m_batch_t *batch, m_rank_t rank) {
+#if BATCH_AGGREGATE
+  // the records buffer is no longer needed once summarised, reuse it
+  uint8_t *summary = batch->records;
+  int mean = batch->count > 0 ? batch->sum / batch->count : 0;
+  put_int16(&summary[0], batch->min);
+  put_int16(&summary[2], batch->max);
+  put_int16(&summary[4], mean);
+  m_packet_t packet = new_app_message(rank, APP_LGT_AGG, batch->count);
+  set_packet_payload(&packet, summary, 6);
+#else
+  m_packet_t packet = new_app_message(rank, APP_LGT_BATCH, batch->count);
+  set_packet_payload(&packet, batch->records, batch->count * BATCH_RECORD_LEN);
+#endif
+  if (batch->traced) {
+    packet.trace = batch->trace;
+    packet.received = batch->received;
+    packet.flags |= PKT_FLAG_TRACE;
+  }
+  return packet;
+}
+
+void batch_reset(m_batch_t *batch) {
+  batch->count = 0;
+  batch->sum = 0;
+  batch->traced = 0;
+}
+
+int batch_record(const m_packet_t *packet, int i, linkaddr_t *src, int *value) {
+  if (!(packet->flags & PKT_FLAG_PAYLOAD) || (i + 1) * BATCH_RECORD_LEN > packet->payload_len)
+    return 0;
+
+  const uint8_t *record = &packet->payload[i * BATCH_RECORD_LEN];
+  memcpy(src->u8, record, LINKADDR_SIZE);
+  *value = get_int16(&record[LINKADDR_SIZE]);
+  return 1;
+}
+
+int agg_field(const m_packet_t *packet, int i) {
+  if (!(packet->flags & PKT_FLAG_PAYLOAD) || (i + 1) * 2 > packet->payload_len)
+    return 0;
+  return get_int16(&packet->payload[i * 2]);
+}
+
+static int packet_len(uint8_t msgcat, uint8_t flags) {
+  int len = PKT_HEADER_LEN;
+  if (msgcat == HELLO)
+    len += 2; // depth + load
+  if (msgcat == HELLO_ACK)
+    len += 1; // cats
+  if (msgcat == APPLICATION)
+    len += 1 + 2; // appcat + value
+  if (flags & PKT_FLAG_SEQ)
+    len += 1;
+  if (flags & PKT_FLAG_SRC)
+    len += LINKADDR_SIZE;
+  if (flags & PKT_FLAG_DST)
+    len += LINKADDR_SIZE;
+  if (flags & PKT_FLAG_TRACE)
+    len += TRACE_LEN;
+  return len;
+}
+
+int encode_packet(const m_packet_t *packet, uint8_t *buf, int size) {
+  int len = packet_len(packet->msgcat, packet->flags);
+  if (packet->flags & PKT_FLAG_PAYLOAD)
+    len += 1 + packet->payload_len;
+  if (len > size)
+    return -1;
+
+  int pos = 0;
+  buf[pos++] = PROTO_VERSION;
+  buf[pos++] = packet->flags;
+  buf[pos++] = packet->rank;
+  buf[pos++] = packet->msgcat;
+  if (packet->msgcat == HELLO) {
+    buf[pos++] = packet->depth;
+    buf[pos++] = packet->load;
+  }
+  if (packet->msgcat == HELLO_ACK)
+    buf[pos++] = packet->cats;
+  if (packet->msgcat == APPLICATION) {
+    buf[pos++] = packet->appcat;
+    put_int16(&buf[pos], packet->value);
+    pos += 2;
+  }
+  if (packet->flags & PKT_FLAG_SEQ) {
+    buf[pos++] = packet->seq;
+  }
+  if (packet->flags & PKT_FLAG_SRC) {
+    memcpy(&buf[pos], packet->src.u8, LINKADDR_SIZE);
+    pos += LINKADDR_SIZE;
+  }
+  if (packet->flags & PKT_FLAG_DST) {
+    memcpy(&buf[pos], packet->dst.u8, LINKADDR_SIZE);
+    pos += LINKADDR_SIZE;
+  }
+  if (packet->flags & PKT_FLAG_TRACE) {
+    put_int16(&buf[pos], packet->trace.origin);
+    buf[pos + 2] = packet->trace.hops;
+    put_int16(&buf[pos + 3], packet->trace.residence);
+    pos += TRACE_LEN;
+  }
+  if (packet->flags & PKT_FLAG_PAYLOAD) {
+    buf[pos++] = packet->payload_len;
+    memcpy(&buf[pos], packet->payload, packet->payload_len);
+    pos += packet->payload_len;
+  }
+  return pos;
+}
+
+int decode_packet(const void *data, uint16_t len, m_packet_t *packet) {
+  const uint8_t *buf = data;
+
+  if (len < PKT_HEADER_LEN || buf[0] != PROTO_VERSION)
+    return 0;
+  if (buf[2] > SENSOR || buf[3] >= NB_MSGCAT)
+    return 0;
+  int fixed_len = packet_len(buf[3], buf[1]);
+  if (buf[1] & PKT_FLAG_PAYLOAD) {
+    if (len < fixed_len + 1 || len != fixed_len + 1 + buf[fixed_len])
+      return 0;
+  } else if (len != fixed_len) {
+    return 0;
+  }
+
+  *packet = new_message(buf[2], buf[3]);
+  packet->flags = buf[1];
+
+  int pos = PKT_HEADER_LEN;
+  if (packet->msgcat == HELLO) {
+    packet->depth = buf[pos++];
+    packet->load = buf[pos++];
+  }
+  if (packet->msgcat == HELLO_ACK)
+    packet->cats = buf[pos++];
+  if (packet->msgcat == APPLICATION) {
+    if (buf[pos] >= NB_APPCAT)
+      return 0;
+    packet->appcat = buf[pos++];
+    packet->value = get_int16(&buf[pos]);
+    pos += 2;
+  }
+  if (packet->flags & PKT_FLAG_SEQ) {
+    packet->seq = buf[pos++];
+  }
+  if (packet->flags & PKT_FLAG_SRC) {
+    memcpy(packet->src.u8, &buf[pos], LINKADDR_SIZE);
+    pos += LINKADDR_SIZE;
+  }
+  if (packet->flags & PKT_FLAG_DST) {
+    memcpy(packet->dst.u8, &buf[pos], LINKADDR_SIZE);
+    pos += LINKADDR_SIZE;
+  }
+  if (packet->flags & PKT_FLAG_TRACE) {
+    packet->trace.origin = get_int16(&buf[pos]);
+    packet->trace.hops = buf[pos + 2];
+    packet->trace.residence = get_int16(&buf[pos + 3]);
+    pos += TRACE_LEN;
+  }
+  if (packet->flags & PKT_FLAG_PAYLOAD) {
+    packet->payload_len = buf[pos++];
+    packet->payload = &buf[pos];
+  }
+  return 1;
+}
+
+static int ewma(int average, int sample) {
+  return average + (sample - average) / (1 << LINK_EWMA_SHIFT);
+}
+
+static uint16_t add_sat16(uint16_t counter, int n) {
+  return counter + n > 0xffff ? 0xffff : counter + n;
+}
+
+static void tx_next(void);
+
+// the callback argument is the frame's accounting class and neighbour slot
+static void link_sent(void *ptr, int status, int transmissions) {
+  int slot = (intptr_t)ptr & 0xff;
+  int class = (intptr_t)ptr >> 8;
+  if (tx_pending > 0)
+    tx_pending--;
+  // transmit time since the previous frame completed
+  energest_flush();
+  uint64_t transmit = energest_type_time(ENERGEST_TYPE_TRANSMIT);
+  acct[class].tx_time += transmit - acct_last_transmit;
+  acct_last_transmit = transmit;
+  if (slot != 0xff && addr_table_get(&neighbors, slot) != NULL) {
+    int sample = status == MAC_TX_OK ? transmissions : LINK_ETX_NOACK;
+    links[slot].etx = ewma(links[slot].etx, sample * LINK_SCALE);
+  }
+  tx_next();
+}
+
+// hands the next queued frame to the MAC once the previous one is done
+static void tx_next(void) {
+  if (tx_pending > 0)
+    return;
+  m_tx_entry_t *entry = list_pop(tx_control);
+  if (entry == NULL)
+    entry = list_pop(tx_app);
+  if (entry == NULL)
+    return;
+  tx_queued--;
+
+  // the time spent in the queue belongs to the residence too
+  if (entry->residence != 0) {
+    uint32_t residence = (uint16_t)get_int16(&entry->frame[entry->residence])
+      + clock_ms(clock_time() - entry->queued);
+    put_int16(&entry->frame[entry->residence], residence > 0xffff ? 0xffff : residence);
+  }
+
+  packetbuf_clear();
+  packetbuf_copyfrom(entry->frame, entry->len);
+  packetbuf_set_addr(PACKETBUF_ADDR_RECEIVER, &entry->dest);
+  packetbuf_set_addr(PACKETBUF_ADDR_SENDER, &linkaddr_node_addr);
+  count_stat(entry->msgcat, STAT_TX);
+  if (entry->forwarded)
+    count_stat(entry->msgcat, STAT_FORWARDED);
+  int class = entry->class;
+  if (acct[class].tx_frames < 0xff)
+    acct[class].tx_frames++;
+  acct[class].tx_bytes = add_sat16(acct[class].tx_bytes, entry->len);
+  int slot = linkaddr_cmp(&entry->dest, &linkaddr_null) ? -1 : addr_table_find(&neighbors, &entry->dest);
+  memb_free(&tx_pool, entry);
+  tx_pending++;
+  // may call link_sent() right away, and so tx_next(), if the MAC is full
+  NETSTACK_MAC.send(link_sent, (void *)(intptr_t)((class << 8) | (slot & 0xff)));
+}
+
+static void tx_drop(void) {
+  tx_queue_drops++;
+  LOG_WARN("TX queue full, %u frames dropped\n", tx_queue_drops);
+}
+
+// same as nullnet's output, but queued and with a MAC callback for the link estimate
+void send_packet(const m_packet_t *packet, const linkaddr_t *dest) {
+  // the parent is the null address while a node is detached
+  if (dest != NULL && linkaddr_cmp(dest, &linkaddr_null)) {
+    count_stat(packet->msgcat, STAT_NO_PARENT);
+    return;
+  }
+  int control = packet->msgcat != APPLICATION && packet->msgcat != NULL_MSG;
+  m_tx_entry_t *entry = memb_alloc(&tx_pool);
+  if (entry == NULL && control) {
+    entry = list_chop(tx_app);
+    if (entry != NULL) {
+      tx_queued--;
+      tx_drop();
+    }
+  }
+  if (entry == NULL) {
+    tx_drop();
+    return;
+  }
+  int len = encode_packet(packet, entry->frame, sizeof(entry->frame));
+  if (len < 0) {
+    memb_free(&tx_pool, entry);
+    return;
+  }
+  entry->len = len;
+  // the trace ends the header, the residence ends the trace
+  entry->residence = packet->flags & PKT_FLAG_TRACE ? packet_len(packet->msgcat, packet->flags) - 2 : 0;
+  entry->queued = clock_time();
+  linkaddr_copy(&entry->dest, dest != NULL ? dest : &linkaddr_null);
+  entry->msgcat = packet->msgcat;
+  entry->class = ACCT_CLASS(packet->msgcat, packet->appcat);
+  entry->forwarded = packet->flags & PKT_FLAG_SRC && !linkaddr_cmp(&packet->src, &linkaddr_node_addr);
+  list_add(control ? tx_control : tx_app, entry);
+  if (++tx_queued > tx_queue_peak)
+    tx_queue_peak = tx_queued;
+
+  // a unicast only proves we are alive to the parent if we have no children
+  if (packet->msgcat != HELLO && (dest == NULL || node_children == NULL || node_children->count == 0))
+    last_traffic = clock_time();
+  leaf_wake();
+  tx_next();
+}
+
+int receive_packet(const void *data, uint16_t len, m_packet_t *packet) {
+  if (!decode_packet(data, len, packet)) {
+    const uint8_t *buf = data;
+    count_stat(len >= PKT_HEADER_LEN && buf[3] < NB_MSGCAT ? buf[3] : NULL_MSG, STAT_MALFORMED);
+    return 0;
+  }
+  packet->received = clock_time();
+  count_stat(packet->msgcat, STAT_RX);
+  int class = ACCT_CLASS(packet->msgcat, packet->appcat);
+  if (acct[class].rx_frames < 0xff)
+    acct[class].rx_frames++;
+  acct[class].rx_bytes = add_sat16(acct[class].rx_bytes, len);
+  // 32 us per byte at 250 kbit/s
+  acct[class].rx_time += (uint32_t)(len + ACCT_FRAME_OVERHEAD) * 32 * ENERGEST_SECOND / 1000000;
+  return 1;
+}
+
+static int energest_ms(uint32_t ticks) {
+  uint32_t ms = (uint64_t)ticks * 1000 / ENERGEST_SECOND;
+  return ms > 0x7fff ? 0x7fff : ms;
+}
+
+/*
+ * Fills the next APP_ENERGY frame of the report and returns 1, or 0 once
+ * every class was sent. Counting starts over when a report begins.
+ */
+int energy_report(m_packet_t *packet, int *cursor) {
+  if (*cursor == 0) {
+    log_duty_cycle();
+    memcpy(acct_report, acct, sizeof(acct));
+    memset(acct, 0, sizeof(acct));
+  }
+  int pos = ENERGY_HEADER_LEN;
+  for (; *cursor < ACCT_CLASSES && pos < ENERGY_PAYLOAD_MAX; (*cursor)++) {
+    const m_acct_t *counters = &acct_report[*cursor];
+    if (counters->tx_frames == 0 && counters->rx_frames == 0)
+      continue;
+    energy_buf[pos] = *cursor;
+    energy_buf[pos + 1] = counters->tx_frames;
+    energy_buf[pos + 2] = counters->rx_frames;
+    put_int16(&energy_buf[pos + 3], counters->tx_bytes);
+    put_int16(&energy_buf[pos + 5], counters->rx_bytes);
+    put_int16(&energy_buf[pos + 7], energest_ms(counters->tx_time));
+    put_int16(&energy_buf[pos + 9], energest_ms(counters->rx_time));
+    pos += ENERGY_RECORD_LEN;
+  }
+  if (pos == ENERGY_HEADER_LEN)
+    return 0;
+  for (int i = 0; i < 3; i++) {
+    put_int16(&energy_buf[2 * i], duty_cycle[i]);
+  }
+  int records = (pos - ENERGY_HEADER_LEN) / ENERGY_RECORD_LEN;
+  *packet = new_app_message(node_rank, APP_ENERGY, records);
+  set_packet_origin(packet);
+  set_packet_payload(packet, energy_buf, pos);
+  return 1;
+}
+
+// field 0-2 of record -1 are the duty cycles, fields 0-6 of a record as laid out above
+int energy_field(const m_packet_t *packet, int record, int field) {
+  if (record < 0)
+    return get_int16(&packet->payload[2 * field]);
+  const uint8_t *buf = &packet->payload[ENERGY_HEADER_LEN + record * ENERGY_RECORD_LEN];
+  return field < 3 ? buf[field] : (uint16_t)get_int16(&buf[3 + 2 * (field - 3)]);
+}
+
+void count_stat(m_msgcat_t msgcat, m_stat_t stat) {
+  stats[msgcat][stat] = add_sat16(stats[msgcat][stat], 1);
+}
+
+static int stats_records(void) {
+  int records = 0;
+  for (int i = 0; i < NB_MSGCAT; i++) {
+    for (int j = 0; j < NB_STATS; j++) {
+      if (stats[i][j] > 0) {
+        records++;
+        break;
+      }
+    }
+  }
+  return records;
+}
+
+/*
+ * Fills the next APP_STATS frame of the answer and returns 1, or 0 once
+ * every msgcat with a counter set was sent. Counters are not reset.
+ */
+int stats_report(m_packet_t *packet, int *cursor) {
+  int pos = STATS_HEADER_LEN;
+  for (; *cursor < NB_MSGCAT && pos < STATS_PAYLOAD_MAX; (*cursor)++) {
+    int used = 0;
+    for (int j = 0; j < NB_STATS; j++) {
+      put_int16(&stats_buf[pos + 1 + 2 * j], stats[*cursor][j]);
+      used |= stats[*cursor][j] > 0;
+    }
+    if (!used)
+      continue;
+    stats_buf[pos] = *cursor;
+    pos += STATS_RECORD_LEN;
+  }
+  if (pos == STATS_HEADER_LEN)
+    return 0;
+  stats_buf[0] = node_children != NULL ? node_children->count : 0;
+  put_int16(&stats_buf[1], parent_changes);
+  stats_buf[3] = stats_records();
+  stats_buf[4] = tx_queue_peak;
+  put_int16(&stats_buf[5], tx_queue_drops);
+  int records = (pos - STATS_HEADER_LEN) / STATS_RECORD_LEN;
+  *packet = new_app_message(node_rank, APP_STATS, records);
+  set_packet_origin(packet);
+  set_packet_payload(packet, stats_buf, pos);
+  return 1;
+}
+
+// fields 0-4 of record -1 are the header, fields 0-NB_STATS of a record as laid out above
+int stats_field(const m_packet_t *packet, int record, int field) {
+  static const uint8_t header_offsets[] = { 0, 1, 3, 4, 5 };
+  if (record < 0) {
+    const uint8_t *buf = &packet->payload[header_offsets[field]];
+    return field == 1 || field == 4 ? (uint16_t)get_int16(buf) : buf[0];
+  }
+  const uint8_t *buf = &packet->payload[STATS_HEADER_LEN + record * STATS_RECORD_LEN];
+  return field == 0 ? buf[0] : (uint16_t)get_int16(&buf[1 + 2 * (field - 1)]);
+}
+
+static void send_hello(void *ptr, uint8_t suppress) {
+  clock_time_t now = clock_time();
+  // a parent that stays quiet for too long loses its children
+  if (suppress == TRICKLE_TIMER_TX_SUPPRESS && now - last_hello < HELLO_MAX_SILENCE)
+    return;
+  // once stable, recent traffic every neighbour heard stands in for the beacon
+  if (hello_timer.i_cur >= hello_timer.i_max_abs && now - last_traffic < HELLO_MAX_SILENCE
+      && hello_skips < HELLO_MAX_SKIPS) {
+    hello_skips++;
+    return;
+  }
+  m_packet_t msg = new_message(node_rank, HELLO);
+  msg.depth = node_depth;
+  msg.load = node_children->count;
+  send_packet(&msg, NULL);
+  last_hello = now;
+  hello_skips = 0;
+}
+
+void hello_start(void) {
+  // nobody may pick a sleepy leaf as parent
+  if (node_sleepy || trickle_timer_is_running(&hello_timer))
+    return;
+  trickle_timer_config(&hello_timer, HELLO_IMIN, HELLO_IMAX_DOUBLINGS, HELLO_REDUNDANCY);
+  trickle_timer_set(&hello_timer, send_hello, NULL);
+}
+
+void hello_stop(void) {
+  trickle_timer_stop(&hello_timer);
+}
+
+// a node of our rank beaconing makes our own beacon redundant
+void hello_heard(m_rank_t rank) {
+  if (rank == node_rank && trickle_timer_is_running(&hello_timer))
+    trickle_timer_consistency(&hello_timer);
+}
+
+// joined, changed parent, gained or lost a child: beacon fast again
+void hello_inconsistent(void) {
+  if (node_sleepy)
+    return;
+  hello_start();
+  trickle_timer_inconsistency(&hello_timer);
+}
+
+int set_node_depth(int depth) {
+  if (depth == node_depth)
+    return 0;
+  node_depth = depth;
+  LOG_INFO("Depth: %u\n", node_depth);
+  return 1;
+}
+
+m_packet_t new_topology_report(void) {
+  m_packet_t msg = new_app_message(node_rank, APP_TOPO, TOPO_VALUE(node_depth, node_children->count));
+  set_packet_origin(&msg);
+  return msg;
+}
+
+void set_node_category(m_sensor_t cat) {
+  node_cats = cat == NO_CAT ? 0 : CAT_BIT(cat);
+}
+
+void child_advertised(int child_slot, const m_packet_t *hello_ack) {
+  if (child_slot < 0 || child_slot >= CHILDREN_TABLE_SIZE)
+    return;
+  child_cats[child_slot] = hello_ack->cats;
+  child_sleepy[child_slot] = (hello_ack->flags & PKT_FLAG_SLEEPY) != 0;
+}
+
+static uint8_t subtree_categories(void) {
+  uint8_t cats = node_cats;
+  for (int i = 0; i < node_children->size; i++) {
+    if (addr_table_get(node_children, i) != NULL)
+      cats |= child_cats[i];
+  }
+  return cats;
+}
+
+m_packet_t new_hello_ack(void) {
+  m_packet_t msg = new_message(node_rank, HELLO_ACK);
+  msg.cats = subtree_categories();
+  if (node_sleepy)
+    msg.flags |= PKT_FLAG_SLEEPY;
+  advertised_cats = msg.cats;
+  return msg;
+}
+
+// the parent has to be told about a device appearing or leaving below us
+int categories_changed(void) {
+  return subtree_categories() != advertised_cats;
+}
+
+static void leaf_sleep_timeout(void *ptr) {
+  leaf_sleep();
+}
+
+void leaf_sleep_enable(int enable) {
+  node_sleepy = enable;
+  if (!enable) {
+    ctimer_stop(&sleep_timer);
+    NETSTACK_RADIO.on();
+  }
+}
+
+void leaf_wake(void) {
+  if (!node_sleepy)
+    return;
+  NETSTACK_RADIO.on();
+  ctimer_set(&sleep_timer, LEAF_AWAKE_WINDOW, leaf_sleep_timeout, NULL);
+}
+
+void leaf_sleep(void) {
+  if (!node_sleepy)
+    return;
+  // frames still queued or in the MAC need the radio
+  if (tx_pending > 0 || tx_queued > 0) {
+    ctimer_set(&sleep_timer, LEAF_AWAKE_WINDOW, leaf_sleep_timeout, NULL);
+    return;
+  }
+  ctimer_stop(&sleep_timer);
+  NETSTACK_RADIO.off();
+}
+
+static void sleepy_queue_expire(void) {
+  for (int i = 0; i < SLEEPY_QUEUE_SIZE; i++) {
+    if (sleepy_queue[i].used && clock_time() - sleepy_queue[i].queued_at > SLEEPY_QUEUE_TIMEOUT)
+      sleepy_queue[i].used = 0;
+  }
+}
+
+static m_queued_t *sleepy_queue_oldest(const linkaddr_t *child) {
+  m_queued_t *oldest = NULL;
+  for (int i = 0; i < SLEEPY_QUEUE_SIZE; i++) {
+    m_queued_t *entry = &sleepy_queue[i];
+    if (!entry->used || (child != NULL && linkaddr_cmp(&entry->child, child) == 0))
+      continue;
+    if (oldest == NULL || entry->queued_at - oldest->queued_at > (clock_time_t)-1 / 2)
+      oldest = entry;
+  }
+  return oldest;
+}
+
+// kept until the child polls; a newer attempt of the same command replaces the old one
+static void sleepy_queue_add(const linkaddr_t *child, const m_packet_t *packet) {
+  if (packet->flags & PKT_FLAG_PAYLOAD)
+    return;
+  sleepy_queue_expire();
+  m_queued_t *slot = NULL;
+  int queued = 0;
+  for (int i = 0; i < SLEEPY_QUEUE_SIZE; i++) {
+    m_queued_t *entry = &sleepy_queue[i];
+    if (!entry->used) {
+      if (slot == NULL)
+        slot = entry;
+      continue;
+    }
+    if (linkaddr_cmp(&entry->child, child) == 0)
+      continue;
+    queued++;
+    if (entry->packet.appcat == packet->appcat && linkaddr_cmp(&entry->packet.src, &packet->src) != 0
+        && linkaddr_cmp(&entry->packet.dst, &packet->dst) != 0) {
+      entry->packet = *packet;
+      return;
+    }
+  }
+  if (queued >= SLEEPY_QUEUE_PER_CHILD || slot == NULL) {
+    slot = sleepy_queue_oldest(queued >= SLEEPY_QUEUE_PER_CHILD ? child : NULL);
+    LOG_INFO("Sleepy queue full, %u commands dropped\n", ++sleepy_queue_drops);
+  }
+  slot->used = 1;
+  linkaddr_copy(&slot->child, child);
+  slot->queued_at = clock_time();
+  slot->packet = *packet;
+}
+
+int child_poll(const linkaddr_t *child) {
+  // child may point into packetbuf, which the first send clears
+  linkaddr_t addr;
+  linkaddr_copy(&addr, child);
+  sleepy_queue_expire();
+  int sent = 0;
+  m_queued_t *entry;
+  while ((entry = sleepy_queue_oldest(&addr)) != NULL) {
+    send_packet(&entry->packet, &addr);
+    entry->used = 0;
+    sent++;
+  }
+  m_packet_t done = new_message(node_rank, NULL_MSG);
+  send_packet(&done, &addr);
+  return sent;
+}
+
+// devices a flooded command is meant for
+static uint8_t command_categories(const m_packet_t *packet) {
+#if CATEGORY_FILTER
+  if (packet->msgcat != APPLICATION)
+    return CAT_ALL;
+  if (packet->appcat == APP_IRG_ON)
+    return CAT_BIT(IRG_SYS);
+  if (packet->appcat == APP_MOB_LGT_SEN && packet->value == 1)
+    return CAT_BIT(LGT_SEN);
+  if (packet->appcat == APP_MOB_LGT_SEN && packet->value == 3)
+    return CAT_BIT(MOB_TER);
+#endif
+  return CAT_ALL;
+}
+
 void update_mote_color(int in_net, m_rank_t rank, m_sensor_t sensor_cat) {
   if (rank == GATEWAY) { // GREY
     if (in_net)
@@ -63,77 +924,393 @@ void update_mote_color(int in_net, m_rank_t rank, m_sensor_t sensor_cat) {
   } 
 }
 
-size_t getsize(void *p) {
-	size_t *in = p;
-	if(in) {
-		--in; 
-		return *in;
-	}
-	return -1;
+static uint8_t addr_hash(const linkaddr_t *addr) {
+  uint8_t hash = 0;
+  for (int i = 0; i < LINKADDR_SIZE; i++) {
+    hash = hash * 31 + addr->u8[i];
+  }
+  return hash;
+}
+
+int addr_table_find(const m_addr_table_t *table, const linkaddr_t *addr) {
+  uint8_t mask = table->size - 1;
+  uint8_t slot = addr_hash(addr) & mask;
+
+  for (int probe = 0; probe < table->size; probe++) {
+    const m_addr_entry_t *entry = &table->entries[slot];
+    if (entry->state == SLOT_EMPTY)
+      break;
+    if (entry->state == SLOT_USED && linkaddr_cmp(&entry->addr, addr) != 0)
+      return slot;
+    slot = (slot + 1) & mask;
+  }
+
+  return -1;
 }
 
-void *realloc(void *ptr, size_t size) {
-	void *newptr;
-	int msize;
-	msize = getsize(ptr);
+int addr_table_add(m_addr_table_t *table, const linkaddr_t *addr) {
+  int slot = addr_table_find(table, addr);
+  if (slot != -1) {
+    // item already added
+    return slot;
+  }
 
-	if (size <= msize) {
-		return ptr;
+  if (table->count == table->size) {
+    table->overflows++;
+    LOG_WARN("Table %s full (%u entries), %u insertions refused\n", table->name, table->size, table->overflows);
+    return -1;
   }
 
-	newptr = malloc(size);
-	memcpy(newptr, ptr, msize);
-	free(ptr);
+  uint8_t mask = table->size - 1;
+  slot = addr_hash(addr) & mask;
+  while (table->entries[slot].state == SLOT_USED) {
+    slot = (slot + 1) & mask;
+  }
+  linkaddr_copy(&table->entries[slot].addr, addr);
+  table->entries[slot].state = SLOT_USED;
+  table->entries[slot].last_heard = clock_time();
+  table->count++;
 
-	return newptr;
+  return slot;
 }
 
-int add_linkaddr(linkaddr_t **set_ptr, int size, const linkaddr_t *item) {
-  linkaddr_t *set = *set_ptr;
-  if (size == 0) {
-    set = (linkaddr_t*) malloc(sizeof(linkaddr_t));
+int addr_table_remove(m_addr_table_t *table, const linkaddr_t *addr) {
+  int slot = addr_table_find(table, addr);
+  if (slot == -1) {
+    // element not found
+    return -1;
   }
 
-  for (int i = 0; i < size; i++) {
-    if (linkaddr_cmp(&set[i], item) != 0)
-      // item already added
-      return size;
+  uint8_t mask = table->size - 1;
+  table->entries[slot].state = SLOT_DELETED;
+  table->count--;
+
+  // a tombstone followed by an empty slot ends no probe chain, free it
+  // (and the tombstones before it) so lookups stay short
+  int pos = slot;
+  while (table->entries[(pos + 1) & mask].state == SLOT_EMPTY && table->entries[pos].state == SLOT_DELETED) {
+    table->entries[pos].state = SLOT_EMPTY;
+    pos = (pos - 1) & mask;
   }
 
-  set = (linkaddr_t*) realloc(set, (size + 1) * sizeof(linkaddr_t));
-  linkaddr_copy(&set[size], item);
-  *set_ptr = set;
-  
-  return ++size;
+  return slot;
+}
+
+const linkaddr_t *addr_table_get(const m_addr_table_t *table, int slot) {
+  if (slot < 0 || slot >= table->size || table->entries[slot].state != SLOT_USED)
+    return NULL;
+  return &table->entries[slot].addr;
+}
+
+int addr_table_touch(m_addr_table_t *table, const linkaddr_t *addr) {
+  int slot = addr_table_find(table, addr);
+  if (slot != -1)
+    table->entries[slot].last_heard = clock_time();
+  return slot;
 }
 
-int find_linkaddr(linkaddr_t **set_ptr, int size, const linkaddr_t *item) {
-  linkaddr_t *set = *set_ptr;
+int addr_table_expire(m_addr_table_t *table, void (*expired)(int slot)) {
+  clock_time_t now = clock_time();
+  int nb_expired = 0;
 
-  for (int i = 0; i < size; i++) {
-    if (linkaddr_cmp(&set[i], item) != 0) {
-      return i;
+  for (int i = 0; i < table->size; i++) {
+    m_addr_entry_t *entry = &table->entries[i];
+    if (entry->state == SLOT_USED && now - entry->last_heard > table->timeout) {
+      linkaddr_t addr = entry->addr;
+      LOG_INFO("%s: %02u%02u.%02u%02u.%02u%02u.%02u%02u timed out\n", table->name, addr.u8[0], addr.u8[1], addr.u8[2], addr.u8[3], addr.u8[4], addr.u8[5], addr.u8[6], addr.u8[7]);
+      addr_table_remove(table, &addr);
+      if (expired != NULL)
+        expired(i);
+      nb_expired++;
     }
   }
 
-  return -1;
+  return nb_expired;
 }
 
-int remove_linkaddr(linkaddr_t **set_ptr, int size, const linkaddr_t *item) {
-  linkaddr_t *set = *set_ptr;
-  
-  int pos = find_linkaddr(set_ptr, size, item);
+int neighbor_heard(const linkaddr_t *addr, const m_packet_t *hello, int rssi) {
+  int slot = addr_table_touch(&neighbors, addr);
+  if (slot == -1) {
+    slot = addr_table_add(&neighbors, addr);
+    if (slot == -1)
+      return -1;
+    links[slot].rssi = rssi * LINK_SCALE;
+    links[slot].etx = LINK_SCALE;
+    links[slot].samples = 0;
+  }
+  links[slot].rssi = ewma(links[slot].rssi, rssi * LINK_SCALE);
+  links[slot].rank = hello->rank;
+  links[slot].depth = hello->depth;
+  links[slot].load = hello->load;
+  if (links[slot].samples < UINT8_MAX)
+    links[slot].samples++;
+  return slot;
+}
 
-  if (pos == -1) {
-    // element not found
-    return size;
+// smoothed RSSI in dB, minus LINK_ETX_COST per expected retransmission
+static int slot_quality(int slot) {
+  return (links[slot].rssi - (links[slot].etx - LINK_SCALE) * LINK_ETX_COST) / LINK_SCALE;
+}
+
+// link quality, less what the candidate's load and depth cost
+static int slot_score(int slot, int is_parent) {
+  // our own parent counts us among its children
+  int load = links[slot].load - (is_parent && links[slot].load > 0);
+  return slot_quality(slot) - load * PARENT_LOAD_COST - links[slot].depth * PARENT_DEPTH_COST;
+}
+
+// a descendant (routed through us, or deeper than us) would close a loop
+static int slot_eligible(int slot) {
+  if (links[slot].depth + 1 > MAX_DEPTH)
+    return 0;
+  if (addr_table_find(&routes, addr_table_get(&neighbors, slot)) != -1)
+    return 0;
+  return node_depth == DEPTH_UNKNOWN || links[slot].depth <= node_depth;
+}
+
+int parent_eligible(const linkaddr_t *candidate) {
+  if (addr_table_find(&routes, candidate) != -1)
+    return 0;
+  int c = addr_table_find(&neighbors, candidate);
+  return c == -1 || slot_eligible(c);
+}
+
+int parent_better(const linkaddr_t *candidate, const linkaddr_t *parent) {
+  int c = addr_table_find(&neighbors, candidate);
+  int p = addr_table_find(&neighbors, parent);
+  if (c == -1 || !slot_eligible(c))
+    return 0;
+  // nothing to compare with, keep the parent rather than churn
+  if (p == -1)
+    return 0;
+  if (links[c].rank != links[p].rank)
+    return links[c].rank < links[p].rank;
+  return links[c].samples >= LINK_MIN_SAMPLES
+    && slot_score(c, 0) >= slot_score(p, 1) + PARENT_SWITCH_MARGIN;
+}
+
+uint16_t count_parent_change(void) {
+  return ++parent_changes;
+}
+
+int backup_parent(const m_addr_table_t *children, linkaddr_t *addr) {
+  clock_time_t now = clock_time();
+  int best = -1;
+  for (int i = 0; i < neighbors.size; i++) {
+    const linkaddr_t *neighbor = addr_table_get(&neighbors, i);
+    if (neighbor == NULL || addr_table_find(children, neighbor) != -1)
+      continue;
+    if (now - neighbors.entries[i].last_heard > BACKUP_FRESHNESS || !slot_eligible(i))
+      continue;
+    // only nodes above us, our subtree may not have noticed the loss yet
+    if (node_depth != DEPTH_UNKNOWN && links[i].depth >= node_depth)
+      continue;
+    if (best == -1 || links[i].rank < links[best].rank
+        || (links[i].rank == links[best].rank && slot_score(i, 0) > slot_score(best, 0)))
+      best = i;
+  }
+  if (best == -1)
+    return -1;
+  linkaddr_copy(addr, addr_table_get(&neighbors, best));
+  return links[best].rank;
+}
+
+void neighbor_touch(const linkaddr_t *addr) {
+  addr_table_touch(&neighbors, addr);
+}
+
+int neighbor_depth(const linkaddr_t *addr) {
+  int slot = addr_table_find(&neighbors, addr);
+  return slot == -1 ? -1 : links[slot].depth;
+}
+
+void neighbor_forget(const linkaddr_t *addr) {
+  addr_table_remove(&neighbors, addr);
+}
+
+int neighbor_expire(void) {
+  return addr_table_expire(&neighbors, NULL);
+}
+
+void route_learn(const linkaddr_t *dest, int child_slot) {
+  if (child_slot < 0)
+    return;
+  int slot = addr_table_add(&routes, dest);
+  if (slot == -1)
+    return;
+  addr_table_touch(&routes, dest);
+  route_next_hop[slot] = child_slot;
+}
+
+const linkaddr_t *route_lookup(const m_addr_table_t *children, const linkaddr_t *dest) {
+  int slot = addr_table_find(children, dest);
+  if (slot != -1)
+    return addr_table_get(children, slot);
+
+  slot = addr_table_find(&routes, dest);
+  if (slot == -1)
+    return NULL;
+  return addr_table_get(children, route_next_hop[slot]);
+}
+
+void route_purge(int child_slot) {
+  for (int i = 0; i < routes.size; i++) {
+    const linkaddr_t *dest = addr_table_get(&routes, i);
+    if (dest != NULL && route_next_hop[i] == child_slot)
+      addr_table_remove(&routes, dest);
+  }
+}
+
+int route_expire(void) {
+  return addr_table_expire(&routes, NULL);
+}
+
+int send_packet_down(const m_packet_t *packet, const m_addr_table_t *children, const linkaddr_t *parent) {
+  if (packet->flags & PKT_FLAG_DST && linkaddr_cmp(&packet->dst, &linkaddr_node_addr) == 0) {
+    const linkaddr_t *next_hop = route_lookup(children, &packet->dst);
+    int slot = next_hop != NULL ? addr_table_find(children, next_hop) : -1;
+    if (slot != -1 && child_sleepy[slot]) {
+      sleepy_queue_add(next_hop, packet);
+      return 0;
+    }
+    if (next_hop != NULL) {
+      send_packet(packet, next_hop);
+      return 1;
+    }
   }
+  // no destination, no route, or we are the destination: hand it to the whole subtree
+  return flood_packet(packet, children, parent);
+}
 
-  set = (linkaddr_t*) realloc(set, (size - 1) * sizeof(linkaddr_t));
-  for (int i = pos; i < size - 1; i++) {
-    set[i] = set[i + 1];
+static int seen_packet(const linkaddr_t *origin, uint8_t seq) {
+  for (int i = 0; i < dup_cache_len; i++) {
+    if (dup_cache[i].seq == seq && linkaddr_cmp(&dup_cache[i].origin, origin) != 0)
+      return 1;
   }
-  *set_ptr = set;
 
-  return --size;
-}
\ No newline at end of file
+  linkaddr_copy(&dup_cache[dup_cache_next].origin, origin);
+  dup_cache[dup_cache_next].seq = seq;
+  dup_cache_next = (dup_cache_next + 1) % DUP_CACHE_SIZE;
+  if (dup_cache_len < DUP_CACHE_SIZE)
+    dup_cache_len++;
+  return 0;
+}
+
+int packet_seen(const m_packet_t *packet) {
+  if (!(packet->flags & PKT_FLAG_SEQ && packet->flags & PKT_FLAG_SRC))
+    return 0;
+  // our own packet echoed back by a neighbour
+  if (linkaddr_cmp(&packet->src, &linkaddr_node_addr) != 0)
+    return 1;
+  if (!seen_packet(&packet->src, packet->seq))
+    return 0;
+  dup_suppressed++;
+  count_stat(packet->msgcat, STAT_DUPLICATE);
+  LOG_INFO("Duplicate %d/%d (seq %u) dropped, %u suppressed\n", packet->msgcat, packet->appcat, packet->seq, dup_suppressed);
+  return 1;
+}
+
+int flood_accept(const m_packet_t *packet, const linkaddr_t *src, const linkaddr_t *parent) {
+  if (parent == NULL || linkaddr_cmp(src, parent) == 0)
+    return 0;
+  return !packet_seen(packet);
+}
+
+#if FLOOD_REPAIR
+static void flood_repair(void *ptr) {
+  m_flood_t *flood = ptr;
+  int sent = 0;
+  for (int i = 0; i < flood->children->size; i++) {
+    const linkaddr_t *child = addr_table_get(flood->children, i);
+    if (child != NULL && flood->unconfirmed[i]) {
+      send_packet(&flood->packet, child);
+      sent++;
+    }
+    flood->unconfirmed[i] = 0;
+  }
+  flood->used = 0;
+  if (sent > 0)
+    LOG_INFO("Flood repair: %d unicast(s)\n", sent);
+}
+
+// a free slot, or the oldest one once its repair is done
+static m_flood_t *flood_slot(void) {
+  m_flood_t *oldest = &floods[0];
+  for (int i = 0; i < FLOOD_REPAIR_SLOTS; i++) {
+    if (!floods[i].used)
+      return &floods[i];
+    if (clock_time() - floods[i].sent_at > clock_time() - oldest->sent_at)
+      oldest = &floods[i];
+  }
+  LOG_INFO("Flood repair slots full, repairing the oldest flood early\n");
+  ctimer_stop(&oldest->timer);
+  flood_repair(oldest);
+  return oldest;
+}
+#endif
+
+int flood_packet(const m_packet_t *packet, const m_addr_table_t *children, const linkaddr_t *parent) {
+  uint8_t cats = command_categories(packet);
+  int targets = 0;
+  for (int i = 0; i < children->size; i++) {
+    const linkaddr_t *child = addr_table_get(children, i);
+    if (child == NULL || (cats != CAT_ALL && !(child_cats[i] & cats)))
+      continue;
+    // sleeping children get it when they poll
+    if (child_sleepy[i])
+      sleepy_queue_add(child, packet);
+    else
+      targets++;
+  }
+  if (targets == 0) {
+#if FLOOD_REPAIR
+    // nobody to re-broadcast to (leaves, or no such device below), confirm explicitly
+    if (parent != NULL && packet->flags & PKT_FLAG_SEQ) {
+      m_packet_t ack = new_message(node_rank, FLOOD_ACK);
+      set_packet_src(&ack, &packet->src);
+      ack.seq = packet->seq;
+      ack.flags |= PKT_FLAG_SEQ;
+      send_packet(&ack, parent);
+    }
+#endif
+    return 0;
+  }
+
+  send_packet(packet, NULL);
+
+#if FLOOD_REPAIR
+  m_flood_t *flood = flood_slot();
+  flood->packet = *packet;
+  flood->children = children;
+  flood->used = 1;
+  flood->sent_at = clock_time();
+  for (int i = 0; i < children->size; i++) {
+    flood->unconfirmed[i] = addr_table_get(children, i) != NULL && (cats == CAT_ALL || child_cats[i] & cats)
+      && !child_sleepy[i];
+  }
+  ctimer_set(&flood->timer, FLOOD_REPAIR_DELAY, flood_repair, flood);
+#endif
+  return 1;
+}
+
+void flood_overhear(const m_packet_t *packet, int child_slot) {
+#if FLOOD_REPAIR
+  if (child_slot < 0 || !(packet->flags & PKT_FLAG_SEQ))
+    return;
+  for (int i = 0; i < FLOOD_REPAIR_SLOTS; i++) {
+    m_flood_t *flood = &floods[i];
+    if (flood->used && flood->packet.flags & PKT_FLAG_SEQ && packet->seq == flood->packet.seq
+        && linkaddr_cmp(&packet->src, &flood->packet.src) != 0)
+      flood->unconfirmed[child_slot] = 0;
+  }
+#endif
+}
+
+void log_children(const m_addr_table_t *children) {
+  LOG_INFO("Node has %d children:\n", children->count);
+  for (int i = 0; i < children->size; i++) {
+    const linkaddr_t *child = addr_table_get(children, i);
+    if (child != NULL)
+      LOG_INFO("> %02u%02u.%02u%02u.%02u%02u.%02u%02u\n", child->u8[0], child->u8[1], child->u8[2], child->u8[3], child->u8[4], child->u8[5], child->u8[6], child->u8[7]);
+  }
+}
@@ -2,14 +2,198 @@
 #define COMMONS_H
 #include <stdio.h> /* For printf() */
 #include <stdlib.h>
+#include <stdint.h>
 #include "net/linkaddr.h"
 #include "sys/log.h"
 #include "sys/clock.h"
 #define LOG_MODULE "App"
 #define LOG_LEVEL LOG_LEVEL_INFO
-#define SEND_INTERVAL (10 * CLOCK_SECOND)
 #define ALIVE_TIMEOUT_INTERVAL (20 * CLOCK_SECOND)
-#define PACKET_LENGTH
+#ifndef CHILD_ALIVE_TIMEOUT
+#define CHILD_ALIVE_TIMEOUT ALIVE_TIMEOUT_INTERVAL
+#endif
+#define CHILDREN_SWEEP_INTERVAL (ALIVE_TIMEOUT_INTERVAL / 4)
+#define PROTO_VERSION 4
+
+/*
+ * HELLO beacons are scheduled by a Trickle timer: Imin after a topology
+ * change, doubling up to Imin << HELLO_IMAX_DOUBLINGS while stable. A
+ * beacon is suppressed once HELLO_REDUNDANCY HELLOs from nodes of the
+ * same rank (which offer the same attachment point) were heard in the
+ * interval, but never for longer than HELLO_MAX_SILENCE. With the
+ * defaults two beacons are at most 5 s + 1.5 * 8 s apart, well inside
+ * ALIVE_TIMEOUT_INTERVAL.
+ */
+#ifndef HELLO_IMIN
+#define HELLO_IMIN CLOCK_SECOND
+#endif
+#ifndef HELLO_IMAX_DOUBLINGS
+#define HELLO_IMAX_DOUBLINGS 3
+#endif
+#ifndef HELLO_REDUNDANCY
+#define HELLO_REDUNDANCY 3
+#endif
+#define HELLO_MAX_SILENCE (ALIVE_TIMEOUT_INTERVAL / 4)
+/*
+ * Any frame counts as a keep-alive, so once the interval is at its
+ * maximum a beacon is skipped if the node sent a frame all its neighbours
+ * heard (a broadcast, or a unicast for nodes without children) within
+ * HELLO_MAX_SILENCE, at most HELLO_MAX_SKIPS times in a row so new nodes
+ * still hear about it.
+ */
+#ifndef HELLO_MAX_SKIPS
+#define HELLO_MAX_SKIPS 3
+#endif
+
+#ifndef CHILDREN_TABLE_SIZE
+#define CHILDREN_TABLE_SIZE 16
+#endif
+#if (CHILDREN_TABLE_SIZE & (CHILDREN_TABLE_SIZE - 1)) != 0
+#error "CHILDREN_TABLE_SIZE must be a power of two"
+#endif
+
+#ifndef ROUTES_TABLE_SIZE
+#define ROUTES_TABLE_SIZE 32
+#endif
+#if (ROUTES_TABLE_SIZE & (ROUTES_TABLE_SIZE - 1)) != 0
+#error "ROUTES_TABLE_SIZE must be a power of two"
+#endif
+#ifndef ROUTE_TIMEOUT
+#define ROUTE_TIMEOUT (6 * ALIVE_TIMEOUT_INTERVAL)
+#endif
+
+/*
+ * Link estimation: EWMA (weight 1 / 2^LINK_EWMA_SHIFT) of the RSSI of
+ * every frame heard from a neighbour and of the MAC transmissions needed
+ * to reach it (ETX, LINK_ETX_NOACK when unacknowledged), both kept with
+ * LINK_SCALE fixed-point precision. A same-rank candidate only replaces
+ * the parent once heard LINK_MIN_SAMPLES times and better by at least
+ * PARENT_SWITCH_MARGIN dB, an extra expected transmission costing
+ * LINK_ETX_COST dB.
+ */
+#ifndef NEIGHBOR_TABLE_SIZE
+#define NEIGHBOR_TABLE_SIZE 8
+#endif
+#if (NEIGHBOR_TABLE_SIZE & (NEIGHBOR_TABLE_SIZE - 1)) != 0
+#error "NEIGHBOR_TABLE_SIZE must be a power of two"
+#endif
+#define NEIGHBOR_TIMEOUT (2 * ALIVE_TIMEOUT_INTERVAL)
+/* Only neighbours heard this recently are taken as backup parents */
+#define BACKUP_FRESHNESS ALIVE_TIMEOUT_INTERVAL
+#define LINK_SCALE 16
+#define LINK_EWMA_SHIFT 3
+#define LINK_ETX_NOACK 12
+#define LINK_ETX_COST 3
+#define LINK_MIN_SAMPLES 3
+#ifndef PARENT_SWITCH_MARGIN
+#define PARENT_SWITCH_MARGIN 6
+#endif
+
+/*
+ * HELLOs advertise the sender's hop depth (0 for the gateway) and its
+ * number of children. Candidates deeper than MAX_DEPTH - 1 are never
+ * chosen as parent; among same-rank candidates every child costs
+ * PARENT_LOAD_COST dB and every hop PARENT_DEPTH_COST dB of link quality.
+ * Nodes send their depth and load to the gateway every
+ * TOPO_REPORT_INTERVAL.
+ */
+#ifndef MAX_DEPTH
+#define MAX_DEPTH 8
+#endif
+#define DEPTH_UNKNOWN 0xff
+#ifndef PARENT_LOAD_COST
+#define PARENT_LOAD_COST 2
+#endif
+#ifndef PARENT_DEPTH_COST
+#define PARENT_DEPTH_COST 3
+#endif
+#define TOPO_REPORT_INTERVAL (60 * CLOCK_SECOND)
+#define TOPO_VALUE(depth, load) (((depth) << 8) | (load))
+#define TOPO_DEPTH(value) (((value) >> 8) & 0xff)
+#define TOPO_LOAD(value) ((value) & 0xff)
+
+#ifndef DUP_CACHE_SIZE
+#define DUP_CACHE_SIZE 16
+#endif
+#ifndef FLOOD_REPAIR
+#define FLOOD_REPAIR 0
+#endif
+#define FLOOD_REPAIR_DELAY (CLOCK_SECOND / 2)
+#ifndef FLOOD_REPAIR_SLOTS
+#define FLOOD_REPAIR_SLOTS 3
+#endif
+
+#ifndef BATCH_WINDOW
+#define BATCH_WINDOW (2 * CLOCK_SECOND)
+#endif
+#ifndef BATCH_MAX_RECORDS
+#define BATCH_MAX_RECORDS 8
+#endif
+#ifndef BATCH_AGGREGATE
+#define BATCH_AGGREGATE 0
+#endif
+
+/*
+ * Readings carry a latency trace (LATENCY_TRACE 0 leaves it out): the
+ * origin's clock in ms when it was taken, the number of nodes that
+ * forwarded it and the time it spent inside them, each forwarder adding
+ * the time from reception to its own transmission (trace_forward(),
+ * then the transmit queue when it hands the frame to the MAC).
+ * No clock is shared, only durations measured on one node are added.
+ * Time on the air and in the MAC is not measured, every radio hop adds
+ * TRACE_HOP_MS to the estimate instead.
+ */
+#ifndef LATENCY_TRACE
+#define LATENCY_TRACE 1
+#endif
+#ifndef TRACE_HOP_MS
+#define TRACE_HOP_MS 5
+#endif
+
+/*
+ * HELLO_ACKs advertise the categories (CAT_BIT bitmap) of the sender's
+ * whole subtree, and are sent again to the parent when that changes and
+ * every TOPO_REPORT_INTERVAL. Floods of commands meant for one category
+ * (APP_IRG_ON for irrigation systems, mobile terminal requests and
+ * answers) then only go down when a child's subtree has such a device.
+ * CATEGORY_FILTER 0 floods them everywhere, for comparison.
+ */
+#ifndef CATEGORY_FILTER
+#define CATEGORY_FILTER 1
+#endif
+#define CAT_BIT(cat) (1 << (cat))
+#define CAT_ALL 0xff
+
+/*
+ * Sleepy leaves (sensor built with SLEEPY_LEAF=1) never beacon, so they
+ * never get children, and keep their radio off except for
+ * LEAF_AWAKE_WINDOW after their last frame to or from the parent. They
+ * say so in their HELLO_ACK and wake on their report timer to send a
+ * POLL; the parent answers with the commands it queued for them (at most
+ * SLEEPY_QUEUE_PER_CHILD each, SLEEPY_QUEUE_SIZE overall, dropped after
+ * SLEEPY_QUEUE_TIMEOUT) and a NULL_MSG telling them to go back to sleep.
+ */
+#ifndef SLEEPY_LEAF
+#define SLEEPY_LEAF 0
+#endif
+#define LEAF_AWAKE_WINDOW (CLOCK_SECOND / 4)
+#ifndef SLEEPY_QUEUE_SIZE
+#define SLEEPY_QUEUE_SIZE 8
+#endif
+#define SLEEPY_QUEUE_PER_CHILD 2
+#define SLEEPY_QUEUE_TIMEOUT (30 * CLOCK_SECOND)
+
+/*
+ * Frames are encoded into one of TX_QUEUE_SIZE pool entries by
+ * send_packet() and handed to the MAC one at a time, the next one when
+ * the MAC reports the previous one done. Control frames (all but
+ * application messages and the NULL_MSG that ends a poll answer) go
+ * first. With the pool full a new application frame is dropped, and a
+ * control frame takes the place of the newest application frame if any.
+ */
+#ifndef TX_QUEUE_SIZE
+#define TX_QUEUE_SIZE 6
+#endif
 
 #if MAC_CONF_WITH_TSCH
 #include "net/mac/tsch/tsch.h"
@@ -19,36 +203,316 @@ static linkaddr_t coordinator_addr =  {{ 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0
 
 typedef enum m_rank { GATEWAY, SUBGATEWAY, SENSOR } m_rank_t;
 
-typedef enum m_msgcat { NULL_MSG, HELLO, HELLO_ACK, CHILD_DISCONNECT, APPLICATION } m_msgcat_t;
+typedef enum m_msgcat { NULL_MSG, HELLO, HELLO_ACK, CHILD_DISCONNECT, APPLICATION, FLOOD_ACK, POLL, NB_MSGCAT } m_msgcat_t;
 
-typedef enum m_appcat { NULL_APP, APP_LGT_LVL, APP_LGT_ON, APP_IRG_ON, APP_IRG_ACK, APP_MOB_LGT_SEN } m_appcat_t;
+typedef enum m_appcat { NULL_APP, APP_LGT_LVL, APP_LGT_ON, APP_IRG_ON, APP_IRG_ACK, APP_MOB_LGT_SEN, APP_LGT_BATCH, APP_LGT_AGG, APP_TOPO, APP_CMD_ACK, APP_ENERGY, APP_LATENCY, APP_STATS, NB_APPCAT } m_appcat_t;
 
 typedef enum m_sensor { NO_CAT, IRG_SYS, MOB_TER, LGT_SEN, LGT_BLB } m_sensor_t;
 
+/*
+ * Wire format (all multi-byte fields little-endian):
+ *
+ *   0  version        PROTO_VERSION
+ *   1  flags          PKT_FLAG_* bits, tell which optional fields follow
+ *   2  rank           m_rank_t
+ *   3  msgcat         m_msgcat_t
+ *   4  depth, load    hop depth and number of children, only for HELLO
+ *   4  cats           subtree categories (CAT_BIT), only for HELLO_ACK
+ *   4  appcat         m_appcat_t, only for APPLICATION messages
+ *   .  value          int16, only for APPLICATION messages
+ *   .  seq            origin sequence number, only if PKT_FLAG_SEQ
+ *   .  src            LINKADDR_SIZE bytes, only if PKT_FLAG_SRC
+ *   .  dst            LINKADDR_SIZE bytes, only if PKT_FLAG_DST
+ *   .  trace          origin time (uint16 ms), hops, residence (uint16
+ *                     ms), only if PKT_FLAG_TRACE
+ *   .  payload        length byte + bytes, only if PKT_FLAG_PAYLOAD
+ */
+#define PKT_FLAG_SRC 0x01
+#define PKT_FLAG_DST 0x02
+#define PKT_FLAG_SEQ 0x04
+#define PKT_FLAG_PAYLOAD 0x08
+#define PKT_FLAG_SLEEPY 0x10 /* HELLO_ACK from a sleepy leaf */
+#define PKT_FLAG_TRACE 0x20
+#define TRACE_LEN 5
+
+/* A batch record is a source address followed by its int16 reading */
+#define BATCH_RECORD_LEN (LINKADDR_SIZE + 2)
+#define BATCH_PAYLOAD_MAX (BATCH_MAX_RECORDS * BATCH_RECORD_LEN)
+
+/*
+ * Traffic accounting: every frame sent (send_packet()) or received
+ * (receive_packet()) is counted, with its bytes and radio time, under
+ * its msgcat, or NB_MSGCAT + appcat for application messages. TX time
+ * is measured by Energest between MAC callbacks, RX time is the frame's
+ * airtime at 250 kbit/s with ACCT_FRAME_OVERHEAD bytes of PHY and MAC
+ * framing. Every TOPO_REPORT_INTERVAL nodes send what they counted since
+ * the previous report to the gateway in APP_ENERGY frames whose payload
+ * is the CPU, listen and transmit duty cycles (int16, hundredths of a
+ * percent) followed by up to ENERGY_RECORDS records of
+ *
+ *   class, TX frames, RX frames, TX bytes, RX bytes, TX ms, RX ms
+ *
+ * (one byte each for the first three, int16 for the others).
+ */
+#define ACCT_CLASS(msgcat, appcat) ((msgcat) == APPLICATION ? NB_MSGCAT + (appcat) : (msgcat))
+#define ACCT_CLASSES (NB_MSGCAT + NB_APPCAT)
+#define ACCT_FRAME_OVERHEAD 29
+#define ENERGY_HEADER_LEN 6
+#define ENERGY_RECORD_LEN 11
+#define ENERGY_RECORDS 6
+#define ENERGY_PAYLOAD_MAX (ENERGY_HEADER_LEN + ENERGY_RECORDS * ENERGY_RECORD_LEN)
+
+/*
+ * Counters kept by every node since boot, per msgcat: frames received,
+ * sent, forwarded (sent for another origin), dropped for lack of a
+ * parent, dropped as malformed (under the msgcat of their header,
+ * NULL_MSG if unreadable), dropped as duplicates and left unhandled.
+ * The gateway floods an APP_STATS request (no payload); every node
+ * answers after up to STATS_REPLY_JITTER with APP_STATS frames whose
+ * payload is its number of children, its parent changes (int16), the
+ * number of records of the whole answer, the TX queue's peak depth and
+ * its drops (int16, see TX_QUEUE_SIZE), followed by up to
+ * STATS_RECORDS records of a msgcat and its NB_STATS counters (int16).
+ */
+typedef enum m_stat { STAT_RX, STAT_TX, STAT_FORWARDED, STAT_NO_PARENT, STAT_MALFORMED, STAT_DUPLICATE, STAT_UNHANDLED, NB_STATS } m_stat_t;
+
+#define STATS_HEADER_LEN 7
+#define STATS_RECORD_LEN (1 + 2 * NB_STATS)
+#define STATS_RECORDS 4
+#define STATS_PAYLOAD_MAX (STATS_HEADER_LEN + STATS_RECORDS * STATS_RECORD_LEN)
+#define STATS_REPLY_JITTER (5 * CLOCK_SECOND)
+
+#define PKT_HEADER_LEN 4
+#define PAYLOAD_MAX(a, b) ((a) > (b) ? (a) : (b))
+#define PKT_PAYLOAD_MAX PAYLOAD_MAX(PAYLOAD_MAX(BATCH_PAYLOAD_MAX, ENERGY_PAYLOAD_MAX), STATS_PAYLOAD_MAX)
+#define PKT_MAX_LEN (PKT_HEADER_LEN + 1 + 2 + 1 + 2 * LINKADDR_SIZE + TRACE_LEN + 1 + PKT_PAYLOAD_MAX)
+
+typedef struct m_trace {
+    uint16_t origin;    /* origin clock, ms */
+    uint8_t hops;       /* forwarders so far */
+    uint16_t residence; /* ms spent in them */
+} m_trace_t;
+
 typedef struct m_packet {
     m_rank_t rank;
     m_msgcat_t msgcat;
     m_appcat_t appcat;
     int value;
+    uint8_t flags;
+    uint8_t seq;
+    uint8_t depth; /* HELLO only */
+    uint8_t load;  /* HELLO only */
+    uint8_t cats;  /* HELLO_ACK only */
     linkaddr_t src;
+    linkaddr_t dst;
+    m_trace_t trace;
+    clock_time_t received; /* local, when it was received or traced */
+    const uint8_t *payload; /* points into the received frame or the sender's buffer */
+    uint8_t payload_len;
 } m_packet_t;
 
-m_packet_t encode_message(m_rank_t rank, m_msgcat_t msgcat);
+/*
+ * Light readings buffered by a subgateway before being sent upward as
+ * one APP_LGT_BATCH frame (or one APP_LGT_AGG summary with
+ * BATCH_AGGREGATE).
+ */
+typedef struct m_batch {
+    uint8_t records[BATCH_PAYLOAD_MAX];
+    uint8_t count;
+    int min;
+    int max;
+    long sum;
+    uint8_t traced; /* the first (oldest) record's trace */
+    m_trace_t trace;
+    clock_time_t received;
+} m_batch_t;
+
+m_packet_t new_message(m_rank_t rank, m_msgcat_t msgcat);
+
+m_packet_t new_app_message(m_rank_t rank, m_appcat_t appcat, int value);
+
+void set_packet_src(m_packet_t *packet, const linkaddr_t *src);
+
+void set_packet_dst(m_packet_t *packet, const linkaddr_t *dst);
+
+void set_packet_origin(m_packet_t *packet);
+
+void set_packet_payload(m_packet_t *packet, const uint8_t *payload, uint8_t len);
+
+void set_packet_trace(m_packet_t *packet);
+
+void trace_forward(m_packet_t *packet);
+
+int trace_latency(const m_packet_t *packet);
+
+int batch_add(m_batch_t *batch, const m_packet_t *reading);
+
+m_packet_t batch_packet(m_batch_t *batch, m_rank_t rank);
+
+void batch_reset(m_batch_t *batch);
+
+int batch_record(const m_packet_t *packet, int i, linkaddr_t *src, int *value);
+
+int agg_field(const m_packet_t *packet, int i);
+
+int encode_packet(const m_packet_t *packet, uint8_t *buf, int size);
+
+int decode_packet(const void *data, uint16_t len, m_packet_t *packet);
+
+void send_packet(const m_packet_t *packet, const linkaddr_t *dest);
+
+int receive_packet(const void *data, uint16_t len, m_packet_t *packet);
+
+int energy_report(m_packet_t *packet, int *cursor);
+
+int energy_field(const m_packet_t *packet, int record, int field);
+
+void count_stat(m_msgcat_t msgcat, m_stat_t stat);
 
-m_packet_t encode_app_message(m_rank_t rank, m_appcat_t appcat, int value);
+int stats_report(m_packet_t *packet, int *cursor);
 
-void decode_message(int msg, int* out);
+int stats_field(const m_packet_t *packet, int record, int field);
 
 void update_mote_color(int in_net, m_rank_t rank, m_sensor_t sensor_cat);
 
-size_t getsize(void *p);
+void hello_start(void);
+
+void hello_stop(void);
+
+void hello_heard(m_rank_t rank);
+
+void hello_inconsistent(void);
+
+int set_node_depth(int depth);
+
+m_packet_t new_topology_report(void);
+
+void set_node_category(m_sensor_t cat);
+
+void child_advertised(int child_slot, const m_packet_t *hello_ack);
+
+m_packet_t new_hello_ack(void);
+
+int categories_changed(void);
+
+void leaf_sleep_enable(int enable);
+
+void leaf_wake(void);
+
+void leaf_sleep(void);
+
+int child_poll(const linkaddr_t *child);
+
+/*
+ * Fixed-capacity address table (open addressing on a hash of the link
+ * address). An entry keeps its slot index for as long as it is in the
+ * table, so callers can keep per-entry data in parallel arrays indexed
+ * by slot. The size must be a power of two.
+ *
+ * Every entry also remembers when it was last heard from; entries not
+ * refreshed with addr_table_touch() within the table's timeout are
+ * dropped by the next addr_table_expire() sweep.
+ */
+typedef enum m_slot_state { SLOT_EMPTY, SLOT_USED, SLOT_DELETED } m_slot_state_t;
+
+typedef struct m_addr_entry {
+    linkaddr_t addr;
+    uint8_t state;
+    clock_time_t last_heard;
+} m_addr_entry_t;
+
+typedef struct m_addr_table {
+    m_addr_entry_t *entries;
+    uint8_t size;
+    uint8_t count;
+    uint16_t overflows;
+    clock_time_t timeout;
+    const char *name;
+} m_addr_table_t;
+
+#define ADDR_TABLE(name, size, timeout) \
+    static m_addr_entry_t name##_entries[size]; \
+    static m_addr_table_t name = { name##_entries, size, 0, 0, timeout, #name }
+
+void init_commons(m_rank_t rank, const m_addr_table_t *children);
+
+int addr_table_add(m_addr_table_t *table, const linkaddr_t *addr);
+
+int addr_table_find(const m_addr_table_t *table, const linkaddr_t *addr);
+
+int addr_table_remove(m_addr_table_t *table, const linkaddr_t *addr);
+
+const linkaddr_t *addr_table_get(const m_addr_table_t *table, int slot);
+
+int addr_table_touch(m_addr_table_t *table, const linkaddr_t *addr);
+
+int addr_table_expire(m_addr_table_t *table, void (*expired)(int slot));
+
+/*
+ * Neighbours heard recently, with their rank and link estimate (see
+ * LINK_EWMA_SHIFT). Unicast transmissions to a known neighbour feed its
+ * ETX from the MAC outcome. Candidates that would be too deep, or that
+ * are our descendants (a route goes through us to them, or they are
+ * deeper than us), are never taken as parent. parent_better() keeps the
+ * parent when its link is unknown. backup_parent() picks the best fresh
+ * one (lowest rank, then best score) that is not a child and is
+ * shallower than we were, and returns its rank or -1. A node whose
+ * parent advertises a depth of MAX_DEPTH or more leaves it.
+ */
+int neighbor_heard(const linkaddr_t *addr, const m_packet_t *hello, int rssi);
+
+int neighbor_depth(const linkaddr_t *addr);
+
+void neighbor_touch(const linkaddr_t *addr);
+
+int parent_eligible(const linkaddr_t *candidate);
+
+int parent_better(const linkaddr_t *candidate, const linkaddr_t *parent);
+
+uint16_t count_parent_change(void);
+
+int backup_parent(const m_addr_table_t *children, linkaddr_t *addr);
+
+void neighbor_forget(const linkaddr_t *addr);
+
+int neighbor_expire(void);
+
+/*
+ * Downward routes: every node remembers, for each descendant it has
+ * heard upward traffic from, the slot of the child leading to it.
+ */
+void route_learn(const linkaddr_t *dest, int child_slot);
+
+const linkaddr_t *route_lookup(const m_addr_table_t *children, const linkaddr_t *dest);
+
+void route_purge(int child_slot);
+
+int route_expire(void);
+
+int send_packet_down(const m_packet_t *packet, const m_addr_table_t *children, const linkaddr_t *parent);
+
+/*
+ * Every packet a node originates carries its address and a per-node
+ * sequence number. packet_seen() remembers the last DUP_CACHE_SIZE
+ * (origin, seq) pairs and returns 1, counting a suppressed duplicate,
+ * when the packet was already handled.
+ */
+int packet_seen(const m_packet_t *packet);
 
-void *realloc(void *ptr, size_t size);
+/*
+ * Controlled flooding of tree-wide commands: one broadcast per hop,
+ * taken only from the parent and only once per (origin, seq). With
+ * FLOOD_REPAIR, children that were not heard re-broadcasting (or, for
+ * leaves, acknowledging with FLOOD_ACK) get a unicast copy; up to
+ * FLOOD_REPAIR_SLOTS floods await their repair at once. Commands
+ * for one category skip nodes without such a device below them.
+ */
+int flood_accept(const m_packet_t *packet, const linkaddr_t *src, const linkaddr_t *parent);
 
-int add_linkaddr(linkaddr_t **set_ptr, int size, const linkaddr_t *item);
+int flood_packet(const m_packet_t *packet, const m_addr_table_t *children, const linkaddr_t *parent);
 
-int find_linkaddr(linkaddr_t **set_ptr, int size, const linkaddr_t *item);
+void flood_overhear(const m_packet_t *packet, int child_slot);
 
-int remove_linkaddr(linkaddr_t **set_ptr, int size, const linkaddr_t *item);
+void log_children(const m_addr_table_t *children);
 
 #endif /* COMMONS_H */
\ No newline at end of file
@@ -0,0 +1,150 @@
+"""Writes the Cooja scenarios of the benchmark suite (see README.md).
+
+One gateway, up to SUBGATEWAY_SHARE of the motes as subgateways and
+sensors for the rest, on Sky motes with a UDGM radio medium. Subgateways
+only join the gateway, so they are picked among the motes in its range. Grid layouts space the
+motes SPACING metres apart with the gateway in the middle; random layouts
+spread them over the same area and are redrawn until every mote can reach
+the gateway. The "-kill" variants of the larger sizes are the same
+scenarios, in which metrics.js removes the sensor with the most children
+mid-run. Run it again after changing anything below, the .csc files are
+checked in.
+"""
+import math
+import random
+
+SIZES = [10, 50, 200]
+KILL_SIZES = [50, 200]
+SPACING = 35.0
+TX_RANGE = 50.0
+INTERFERENCE_RANGE = 100.0
+SUBGATEWAY_SHARE = 0.1
+SEED = 123456
+
+MOTE_TYPES = [("gateway", "Gateway"), ("subgateway", "Subgateway"), ("sensor", "Sensor")]
+
+INTERFACES = """\
+      <moteinterface>org.contikios.cooja.interfaces.Position</moteinterface>
+      <moteinterface>org.contikios.cooja.interfaces.RimeAddress</moteinterface>
+      <moteinterface>org.contikios.cooja.interfaces.IPAddress</moteinterface>
+      <moteinterface>org.contikios.cooja.interfaces.Mote2MoteRelations</moteinterface>
+      <moteinterface>org.contikios.cooja.interfaces.MoteAttributes</moteinterface>
+      <moteinterface>org.contikios.cooja.mspmote.interfaces.MspClock</moteinterface>
+      <moteinterface>org.contikios.cooja.mspmote.interfaces.MspMoteID</moteinterface>
+      <moteinterface>org.contikios.cooja.mspmote.interfaces.SkyButton</moteinterface>
+      <moteinterface>org.contikios.cooja.mspmote.interfaces.SkyFlash</moteinterface>
+      <moteinterface>org.contikios.cooja.mspmote.interfaces.SkyCoffeeFilesystem</moteinterface>
+      <moteinterface>org.contikios.cooja.mspmote.interfaces.Msp802154Radio</moteinterface>
+      <moteinterface>org.contikios.cooja.mspmote.interfaces.MspSerial</moteinterface>
+      <moteinterface>org.contikios.cooja.mspmote.interfaces.SkyLED</moteinterface>
+      <moteinterface>org.contikios.cooja.mspmote.interfaces.MspDebugOutput</moteinterface>
+      <moteinterface>org.contikios.cooja.mspmote.interfaces.SkyTemperature</moteinterface>
+"""
+
+
+def grid_layout(n):
+    cols = math.ceil(math.sqrt(n))
+    positions = [((i % cols) * SPACING, (i // cols) * SPACING) for i in range(n)]
+    # gateway closest to the middle of the grid
+    cx = sum(x for x, _ in positions) / n
+    cy = sum(y for _, y in positions) / n
+    middle = min(range(n), key=lambda i: (positions[i][0] - cx) ** 2 + (positions[i][1] - cy) ** 2)
+    positions.insert(0, positions.pop(middle))
+    return positions
+
+
+def connected(positions):
+    seen = {0}
+    todo = [0]
+    while todo:
+        i = todo.pop()
+        for j in range(len(positions)):
+            if j not in seen and math.dist(positions[i], positions[j]) <= TX_RANGE:
+                seen.add(j)
+                todo.append(j)
+    return len(seen) == len(positions)
+
+
+def random_layout(n, rng):
+    side = SPACING * math.ceil(math.sqrt(n))
+    while True:
+        positions = [(side / 2, side / 2)] + [(rng.uniform(0, side), rng.uniform(0, side)) for _ in range(n - 1)]
+        if connected(positions):
+            return [(round(x, 1), round(y, 1)) for x, y in positions]
+
+
+def mote_kinds(positions, rng):
+    n = len(positions)
+    in_range = [i for i in range(1, n) if math.dist(positions[i], positions[0]) <= TX_RANGE]
+    rng.shuffle(in_range)
+    subgateways = in_range[:max(1, round(n * SUBGATEWAY_SHARE))]
+    return [0] + [1 if i in subgateways else 2 for i in range(1, n)]
+
+
+def scenario(name, positions, kinds):
+    out = ['<?xml version="1.0" encoding="UTF-8"?>', "<simconf>", "  <simulation>",
+           f"    <title>{name}</title>",
+           f"    <randomseed>{SEED}</randomseed>",
+           "    <motedelay_us>1000000</motedelay_us>",
+           "    <radiomedium>",
+           "      org.contikios.cooja.radiomediums.UDGM",
+           f"      <transmitting_range>{TX_RANGE}</transmitting_range>",
+           f"      <interference_range>{INTERFERENCE_RANGE}</interference_range>",
+           "      <success_ratio_tx>1.0</success_ratio_tx>",
+           "      <success_ratio_rx>1.0</success_ratio_rx>",
+           "    </radiomedium>",
+           "    <events>",
+           "      <logoutput>40000</logoutput>",
+           "    </events>"]
+    for i, (firmware, description) in enumerate(MOTE_TYPES):
+        out += ["    <motetype>",
+                "      org.contikios.cooja.mspmote.SkyMoteType",
+                f"      <identifier>sky{i + 1}</identifier>",
+                f"      <description>{description}</description>",
+                f'      <source EXPORT="discard">[CONFIG_DIR]/../{firmware}.c</source>',
+                f'      <commands EXPORT="discard">make -C [CONFIG_DIR]/.. {firmware} TARGET=sky</commands>',
+                f'      <firmware EXPORT="copy">[CONFIG_DIR]/../build/sky/{firmware}.sky</firmware>',
+                INTERFACES.rstrip("\n"),
+                "    </motetype>"]
+    for i, ((x, y), kind) in enumerate(zip(positions, kinds)):
+        out += ["    <mote>",
+                "      <breakpoints />",
+                "      <interface_config>",
+                "        org.contikios.cooja.interfaces.Position",
+                f"        <x>{x}</x>",
+                f"        <y>{y}</y>",
+                "        <z>0.0</z>",
+                "      </interface_config>",
+                "      <interface_config>",
+                "        org.contikios.cooja.mspmote.interfaces.MspMoteID",
+                f"        <id>{i + 1}</id>",
+                "      </interface_config>",
+                f"      <motetype_identifier>sky{kind + 1}</motetype_identifier>",
+                "    </mote>"]
+    out += ["  </simulation>",
+            "  <plugin>",
+            "    org.contikios.cooja.plugins.ScriptRunner",
+            "    <plugin_config>",
+            "      <scriptfile>[CONFIG_DIR]/metrics.js</scriptfile>",
+            "      <active>true</active>",
+            "    </plugin_config>",
+            "  </plugin>",
+            "</simconf>"]
+    return "\n".join(out) + "\n"
+
+
+def main():
+    rng = random.Random(SEED)
+    for n in SIZES:
+        for topology, positions in (("grid", grid_layout(n)), ("random", random_layout(n, rng))):
+            kinds = mote_kinds(positions, rng)
+            name = f"{n}-{topology}"
+            with open(f"{name}.csc", "w") as f:
+                f.write(scenario(name, positions, kinds))
+            if n in KILL_SIZES:
+                with open(f"{name}-kill.csc", "w") as f:
+                    f.write(scenario(f"{name}-kill", positions, kinds))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,330 @@
+/*
+ * Cooja ScriptRunner script of the benchmark scenarios. Gives the sensors
+ * mixed categories through their UART, has the gateway send a command
+ * every COMMAND_PERIOD (a light-on to a random bulb, then an irrigation
+ * flood), runs for DURATION and logs one "METRICS {...}" JSON line:
+ *
+ *   pdr                  light readings printed by the gateway / sent
+ *   kept                 readings send-on-delta did not send
+ *   latency_ms           sensor log to gateway [2serv] line (mean, p50, p95)
+ *   trace_latency_ms     the same, as estimated from the readings' traces
+ *   frames_per_reading   reading frames (APP_LGT_LVL and batches) sent by
+ *                        every node, from the APP_ENERGY reports, per
+ *                        delivered reading; frames_total counts all classes
+ *   frames_per_command   "Command <appcat> sent down in <n> frame(s)" of
+ *                        every node, retries included, per command the
+ *                        gateway reported delivered or failed, by appcat
+ *   commands             those reports: [delivered, failed] by appcat
+ *   join_ms              first "Node in network" of every node (mean, max)
+ *   parent_changes       sum of the last "Parent changes" of every node
+ *   outage_ms            time from the last frame of a lost parent to the
+ *                        next parent (mean, p50, p95, max)
+ *   leaf_duty            last "Radio duty cycle" of the sensors nobody has
+ *                        as parent, listen and transmit in hundredths of a
+ *                        percent (mean, p50, p95, max)
+ *
+ * In the "-kill" scenarios the sensor with the most children is removed at
+ * KILL_AT; "killed" then gives its id and children. Its readings are left
+ * out of the PDR, as are the readings sent in the last DRAIN, they may
+ * still be on their way. The gateway must use the text serial format.
+ */
+var DURATION = 30 * 60 * 1000; /* ms */
+var DRAIN = 10 * 1000000; /* us */
+var KILL_AT = 10 * 60 * 1000; /* ms */
+var COMMAND_PERIOD = 30 * 1000; /* ms */
+var COMMAND_VALUE = 5; /* s */
+var CATEGORIES = ["c", "c", "d", "c", "a", "d", "c", "b"];
+/* accounting classes, NB_MSGCAT + appcat as in commons.h */
+var NB_MSGCAT = 7;
+var READING_CLASSES = [NB_MSGCAT + 1, NB_MSGCAT + 6, NB_MSGCAT + 7];
+/* as in commons.h */
+var APPLICATION = 4;
+var APP_LGT_ON = 2;
+var APP_IRG_ON = 3;
+var APP_CMD_ACK = 9;
+var NULL_ADDR = "0000.0000.0000.0000";
+
+TIMEOUT(DURATION + 1000);
+
+var motes = sim.getMotes();
+var addr_of = {};
+var mote_of = {};
+var pending = {};
+var sent = 0;
+var kept = 0;
+var late = 0;
+var delivered = 0;
+var latencies = [];
+var trace_latencies = [];
+var join_us = {};
+var parent_changes = {};
+var parent_of = {};
+var outages = [];
+var duty_of = {};
+var killed = null;
+var reading_frames = 0;
+var total_frames = 0;
+var command_frames = {};
+var commands = {};
+var gateway = null;
+var bulbs = [];
+var next_command = 0;
+var nodes = 0;
+
+function stats(values) {
+  if (values.length == 0)
+    return null;
+  var sorted = values.slice().sort(function(a, b) { return a - b; });
+  var sum = 0;
+  for (var i = 0; i < sorted.length; i++)
+    sum += sorted[i];
+  return {
+    mean: Math.round(sum / sorted.length),
+    p50: sorted[Math.floor(sorted.length * 0.5)],
+    p95: sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * 0.95))],
+    max: sorted[sorted.length - 1]
+  };
+}
+
+function gateway_record(record, now) {
+  if (record.appcat == 1 && record.age === undefined) {
+    if (record.lat !== undefined)
+      trace_latencies.push(record.lat);
+    var queue = pending[record.src];
+    if (queue === undefined)
+      return;
+    // the oldest reading with that value; the ones before it were lost
+    for (var i = 0; i < queue.length; i++) {
+      if (queue[i].value == record.value) {
+        latencies.push(Math.round((now - queue[i].time) / 1000));
+        delivered++;
+        queue.splice(0, i + 1);
+        return;
+      }
+    }
+  } else if (record.appcat == APP_CMD_ACK && record.cmd !== undefined) {
+    if (commands[record.cmd] === undefined)
+      commands[record.cmd] = [0, 0];
+    // 1 delivered, 0 failed, 2 rejected before sending
+    if (record.value == 1)
+      commands[record.cmd][0]++;
+    else if (record.value == 0)
+      commands[record.cmd][1]++;
+  } else if (record.appcat == 10 && record.classes !== undefined) {
+    for (var i = 0; i < record.classes.length; i++) {
+      var c = record.classes[i];
+      total_frames += c[1];
+      if (READING_CLASSES.indexOf(c[0]) != -1)
+        reading_frames += c[1];
+    }
+  }
+}
+
+/* a link-layer address as the nodes print their parent, from its log form */
+function parent_form(addr) {
+  var hex = addr.replace(/\./g, "");
+  var out = "";
+  for (var i = 0; i < hex.length; i += 2) {
+    var byte = "" + parseInt(hex.substring(i, i + 2), 16);
+    out += (byte.length < 2 ? "0" : "") + byte + (i % 4 == 2 && i < hex.length - 2 ? "." : "");
+  }
+  return out;
+}
+
+/* alternately a light-on to a bulb and an irrigation flood */
+function command() {
+  var appcat = next_command++ % 2 == 0 ? APP_LGT_ON : APP_IRG_ON;
+  var dst = NULL_ADDR;
+  if (appcat == APP_LGT_ON) {
+    var known = [];
+    for (var i = 0; i < bulbs.length; i++) {
+      if (addr_of[bulbs[i]] !== undefined)
+        known.push(addr_of[bulbs[i]]);
+    }
+    if (known.length == 0)
+      return;
+    dst = known[sim.getRandomGenerator().nextInt(known.length)];
+  }
+  write(gateway, "[2clie]0|" + APPLICATION + "|" + appcat + "|" + COMMAND_VALUE + "|" + dst);
+}
+
+function kill() {
+  var children = {};
+  for (var id in parent_of)
+    children[parent_of[id]] = (children[parent_of[id]] || 0) + 1;
+  var victim = null;
+  var most = 0;
+  for (var i = 0; i < motes.length; i++) {
+    var addr = addr_of[motes[i].getID()];
+    if (motes[i].getType().getDescription() != "Sensor" || addr === undefined)
+      continue;
+    var n = children[parent_form(addr)] || 0;
+    if (n > most) {
+      victim = motes[i];
+      most = n;
+    }
+  }
+  if (victim == null)
+    return;
+  killed = { id: victim.getID(), children: most };
+  var addr = addr_of[victim.getID()];
+  if (pending[addr] !== undefined) {
+    sent -= pending[addr].length;
+    delete pending[addr];
+  }
+  delete addr_of[victim.getID()];
+  sim.removeMote(victim);
+}
+
+function finish() {
+  var end = sim.getSimulationTime();
+  for (var src in pending) {
+    for (var i = 0; i < pending[src].length; i++) {
+      if (end - pending[src][i].time < DRAIN)
+        late++;
+    }
+  }
+  var joins = [];
+  for (var id in join_us)
+    joins.push(Math.round(join_us[id] / 1000));
+  var changes = 0;
+  for (var id in parent_changes)
+    changes += parent_changes[id];
+  var parents = {};
+  for (var id in parent_of)
+    parents[parent_of[id]] = true;
+  var leaf_listen = [];
+  var leaf_transmit = [];
+  for (var i = 0; i < motes.length; i++) {
+    var id = motes[i].getID();
+    if (motes[i].getType().getDescription() != "Sensor" || addr_of[id] === undefined
+        || duty_of[id] === undefined || parents[parent_form(addr_of[id])])
+      continue;
+    leaf_listen.push(duty_of[id][0]);
+    leaf_transmit.push(duty_of[id][1]);
+  }
+  var per_command = {};
+  for (var appcat in commands) {
+    var resolved = commands[appcat][0] + commands[appcat][1];
+    per_command[appcat] = resolved > 0 ? (command_frames[appcat] || 0) / resolved : null;
+  }
+  var metrics = {
+    scenario: sim.getTitle(),
+    motes: motes.length,
+    duration_s: DURATION / 1000,
+    sent: sent - late,
+    kept: kept,
+    delivered: delivered,
+    pdr: sent - late > 0 ? delivered / (sent - late) : null,
+    latency_ms: stats(latencies),
+    trace_latency_ms: stats(trace_latencies),
+    frames_per_reading: delivered > 0 ? reading_frames / delivered : null,
+    frames_total: total_frames,
+    frames_per_command: per_command,
+    commands: commands,
+    joined: joins.length,
+    nodes: nodes,
+    join_ms: stats(joins),
+    parent_changes: changes,
+    outage_ms: stats(outages),
+    leaf_duty: { listen: stats(leaf_listen), transmit: stats(leaf_transmit) },
+    killed: killed
+  };
+  log.log("METRICS " + JSON.stringify(metrics) + "\n");
+  log.testOK();
+}
+
+/* categories once every mote has booted */
+GENERATE_MSG(2000, "setup");
+YIELD_THEN_WAIT_UNTIL(msg.equals("setup"));
+var sensors = 0;
+for (var i = 0; i < motes.length; i++) {
+  var type = motes[i].getType().getDescription();
+  if (type != "Gateway")
+    nodes++;
+  if (type == "Gateway")
+    gateway = motes[i];
+  if (type == "Sensor") {
+    var category = CATEGORIES[sensors++ % CATEGORIES.length];
+    write(motes[i], category);
+    if (category == "b")
+      bulbs.push(motes[i].getID());
+  }
+}
+GENERATE_MSG(DURATION, "finish");
+GENERATE_MSG(COMMAND_PERIOD, "command");
+if (/-kill$/.test(sim.getTitle()))
+  GENERATE_MSG(KILL_AT, "kill");
+
+while (true) {
+  YIELD();
+  if (msg.equals("finish")) {
+    finish();
+    break;
+  }
+  if (msg.equals("command")) {
+    command();
+    GENERATE_MSG(COMMAND_PERIOD, "command");
+    continue;
+  }
+  if (msg.equals("kill")) {
+    kill();
+    continue;
+  }
+  var m = msg.match(/Link-layer address: ([0-9a-fA-F.]+)/);
+  if (m) {
+    addr_of[id] = m[1].toLowerCase();
+    mote_of[addr_of[id]] = id;
+    continue;
+  }
+  if (msg.indexOf("Light level kept:") != -1) {
+    kept++;
+    continue;
+  }
+  m = msg.match(/Light level: (\d+)/);
+  if (m && addr_of[id] !== undefined) {
+    if (pending[addr_of[id]] === undefined)
+      pending[addr_of[id]] = [];
+    pending[addr_of[id]].push({ value: parseInt(m[1]), time: time });
+    sent++;
+    continue;
+  }
+  if (msg.indexOf("Node in network") != -1) {
+    if (join_us[id] === undefined)
+      join_us[id] = time;
+    continue;
+  }
+  m = msg.match(/Set ([0-9.]+) as parent/);
+  if (m) {
+    parent_of[id] = m[1];
+    continue;
+  }
+  m = msg.match(/Command (\d+) sent down in (\d+) frame/);
+  if (m) {
+    command_frames[m[1]] = (command_frames[m[1]] || 0) + parseInt(m[2]);
+    continue;
+  }
+  m = msg.match(/Radio duty cycle: listen (\d+)\.(\d+)%, transmit (\d+)\.(\d+)%/);
+  if (m) {
+    duty_of[id] = [parseInt(m[1], 10) * 100 + parseInt(m[2], 10), parseInt(m[3], 10) * 100 + parseInt(m[4], 10)];
+    continue;
+  }
+  m = msg.match(/Outage: (\d+) ms/);
+  if (m) {
+    outages.push(parseInt(m[1]));
+    continue;
+  }
+  m = msg.match(/Parent changes: (\d+)/);
+  if (m) {
+    parent_changes[id] = parseInt(m[1]);
+    continue;
+  }
+  var start = msg.indexOf("[2serv]");
+  if (start != -1) {
+    try {
+      gateway_record(JSON.parse(msg.substring(start + 7)), time);
+    } catch (e) {
+      // truncated line
+    }
+  }
+}
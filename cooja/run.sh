@@ -0,0 +1,25 @@
+#!/bin/sh
+# Runs the given scenarios (all of them by default) without GUI and
+# appends their METRICS line, tagged with the current commit, to
+# results/<scenario>.jsonl. CONTIKI defaults to the tree the Makefile uses.
+cd "$(dirname "$0")"
+CONTIKI=${CONTIKI:-$(cd ../../.. && pwd)}
+COOJA_DIR=${COOJA_DIR:-$CONTIKI/tools/cooja}
+COMMIT=$(git rev-parse --short HEAD)
+mkdir -p results
+
+[ $# -eq 0 ] && set -- *.csc
+for csc in "$@"; do
+  name=$(basename "$csc" .csc)
+  scenario=$(cd "$(dirname "$csc")" && pwd -P)/$(basename "$csc")
+  logdir=$(pwd)/results/$name.log.d
+  mkdir -p "$logdir"
+  (cd "$COOJA_DIR" && ./gradlew --quiet run --args="--no-gui --logdir=$logdir $scenario") || echo "$name: cooja failed" >&2
+  line=$(grep -h "METRICS " "$logdir"/COOJA.testlog | tail -n 1 | sed 's/^.*METRICS //')
+  if [ -z "$line" ]; then
+    echo "$name: no metrics" >&2
+    continue
+  fi
+  echo "$line" | sed "s/^{/{\"commit\":\"$COMMIT\",/" >> "results/$name.jsonl"
+  echo "$name: $line"
+done
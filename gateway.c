@@ -9,66 +9,731 @@
 #include "commons.h"
 #include "dev/serial-line.h"
 #include "dev/uart0.h"
+#include "lib/crc16.h"
+
+/*
+ * With SERIAL_BINARY the link with the server uses SLIP-delimited frames
+ * instead of [2serv]/[2clie] text lines. Frame (before SLIP escaping):
+ *
+ *   type (SERIAL_FRAME_*), record count, records..., CRC-16 (lib/crc16, LE)
+ *
+ * and every record is
+ *
+ *   length, rank, msgcat, appcat, value (int16 LE), address, extra int16s
+ *
+ * where the address is the source for readings and the target for
+ * commands. APP_LGT_AGG records carry min, max and mean as extras,
+ * APP_CMD_ACK status records the command's appcat and attempt count,
+ * readings sent from the cache their age, time and category, traced
+ * readings their latency, hops, origin time and category (see below),
+ * APP_LATENCY records their histogram buckets, APP_STATS records a
+ * node's counters (see below), and APP_ENERGY reports become one record
+ * with value -1 and the three duty cycles, then one per accounting class
+ * (the value) with its six counters. In text mode an APP_ENERGY frame is one line, with "duty"
+ * and "classes" arrays in the same order.
+ */
+#ifndef SERIAL_BINARY
+#define SERIAL_BINARY 0
+#endif
+#define SERIAL_FRAME_RECORDS 0x01
+#define SERIAL_FRAME_COMMANDS 0x02
+#define SERIAL_FRAME_MAX 128
+#define SERIAL_RECORD_LEN (6 + LINKADDR_SIZE)
+#define SERIAL_FLUSH_DELAY (CLOCK_SECOND / 4)
+
+#define SLIP_END 0xc0
+#define SLIP_ESC 0xdb
+#define SLIP_ESC_END 0xdc
+#define SLIP_ESC_ESC 0xdd
+
+#define SERIAL_LINE_MAX 64
+#define ENERGY_LINE_MAX 320
+
+/*
+ * Everything sent to the server goes through a ring buffer drained by
+ * serial_tx_process, so the radio input callback never waits on the
+ * UART. Each record is stored behind a 2-byte length and written out
+ * whole; records that do not fit are dropped and counted.
+ */
+#ifndef SERIAL_TX_BUF_SIZE
+#define SERIAL_TX_BUF_SIZE 512
+#endif
+#if (SERIAL_TX_BUF_SIZE & (SERIAL_TX_BUF_SIZE - 1)) != 0
+#error "SERIAL_TX_BUF_SIZE must be a power of two"
+#endif
+#define SERIAL_RECORD_MAX (2 * (SERIAL_FRAME_MAX + 2) + 2)
+
+/*
+ * Commands sent down wait in a pending table until their target (any
+ * irrigation system for APP_IRG_ON) answers with an APP_CMD_ACK carrying
+ * the command's seq. Unanswered commands are sent again with a new seq
+ * after CMD_ACK_TIMEOUT, doubled at every attempt, up to CMD_MAX_ATTEMPTS.
+ * The outcome goes to the server as an APP_CMD_ACK record from the
+ * gateway whose value is one of CMD_*.
+ */
+#ifndef CMD_PENDING_SIZE
+#define CMD_PENDING_SIZE 8
+#endif
+#ifndef CMD_MAX_ATTEMPTS
+#define CMD_MAX_ATTEMPTS 4
+#endif
+#ifndef CMD_MAX_INFLIGHT
+#define CMD_MAX_INFLIGHT 1
+#endif
+#define CMD_ACK_TIMEOUT (2 * CLOCK_SECOND)
+#define CMD_FAILED 0
+#define CMD_DELIVERED 1
+#define CMD_REJECTED 2
+
+/*
+ * A delivered command stays in the table while it is in effect (its
+ * value is a duration in seconds). A new command for the same target and
+ * appcat that would end at most CMD_COALESCE_WINDOW later is merged into
+ * it, and one still waiting or in flight is extended instead of resent.
+ * New commands take a token from a per-target bucket (one every
+ * CMD_TARGET_PERIOD, up to CMD_TARGET_BURST) and from a global one; when
+ * either is empty they are deferred until a token comes back.
+ * Retransmissions are not rate limited, their backoff bounds them.
+ */
+#define CMD_COALESCE_WINDOW (2 * CLOCK_SECOND)
+#ifndef CMD_TARGET_PERIOD
+#define CMD_TARGET_PERIOD (5 * CLOCK_SECOND)
+#endif
+#ifndef CMD_TARGET_BURST
+#define CMD_TARGET_BURST 2
+#endif
+#ifndef CMD_GLOBAL_PERIOD
+#define CMD_GLOBAL_PERIOD (CLOCK_SECOND / 2)
+#endif
+#ifndef CMD_GLOBAL_BURST
+#define CMD_GLOBAL_BURST 4
+#endif
+#define CMD_BUCKETS_SIZE 16
+
+/*
+ * Last READING_HISTORY readings of every sensor (light levels, and the
+ * irrigation state of irrigation systems) with their arrival time and the
+ * sensor's category, so the server can ask for them instead of waiting
+ * for the next report; sensors in send-on-delta mode may stay silent for
+ * a while. Times are in seconds modulo READING_TIME_MASK + 1 to fit in a
+ * record value. The server asks with an APP_LGT_LVL command:
+ *
+ *   to a sensor                         its latest reading
+ *   to the null address, QUERY_SNAPSHOT the latest reading of every sensor
+ *   to the null address, value t >= 0   every reading since time t
+ *
+ * Answers are reading records with their age, time and category. The
+ * last two end with a gateway record whose value is the number of
+ * readings sent and whose time is the t to use for the next delta. They
+ * go out as the serial buffer drains, a new query abandons the previous
+ * one. Nothing is sent over the radio.
+ */
+#ifndef READINGS_TABLE_SIZE
+#define READINGS_TABLE_SIZE 32
+#endif
+#ifndef READING_HISTORY
+#define READING_HISTORY 4
+#endif
+#define READING_TIMEOUT (10 * 60 * CLOCK_SECOND)
+#define READING_TIME_MASK 0x7fff
+#define QUERY_SNAPSHOT -1
+
+/*
+ * Traced readings (see LATENCY_TRACE) go to the server with their
+ * estimated latency in ms, number of radio hops, origin time and
+ * category, and are counted in per-category latency and hop histograms.
+ * Latency buckets end at latency_bounds, the last one takes the rest;
+ * hop bucket i counts readings that came over i radio hops (MAX_DEPTH or
+ * more in the last one). Readings from a batch all get the trace of its
+ * oldest one. An APP_LATENCY command (to any address) sends one record per
+ * category with samples, value the category, extras the latency buckets
+ * then the hop buckets, and clears them if its value is not 0.
+ */
+#define LATENCY_BUCKETS 10
+#define HOP_BUCKETS (MAX_DEPTH + 1)
+#define LATENCY_LINE_MAX 256
+
+/*
+ * APP_STATS answers (see commons.h) are put back together per node, for
+ * up to STATS_PENDING_SIZE nodes at a time, and go to the server as one
+ * record per node once all its records arrived: value the number of
+ * children, extras the parent changes, the TX queue's peak depth and
+ * drops, then the NB_STATS counters of every msgcat in order (a
+ * "counters" array per msgcat in text mode).
+ * Answers still incomplete after STATS_PENDING_TIMEOUT are dropped.
+ */
+#ifndef STATS_PENDING_SIZE
+#define STATS_PENDING_SIZE 8
+#endif
+#define STATS_PENDING_TIMEOUT (2 * STATS_REPLY_JITTER)
+#define STATS_LINE_MAX 448
+
+/* Nodes whose APP_TOPO report (depth, number of children) is known */
+#ifndef TOPO_TABLE_SIZE
+#define TOPO_TABLE_SIZE 64
+#endif
 
 
 /*---------------------------------------------------------------------------*/
 
 static int in_net = 1;
 static m_rank_t rank = GATEWAY;
-static linkaddr_t *children;
-static int nb_children;
-static linkaddr_t *dead_children;
-static int nb_dead_children;
+ADDR_TABLE(children, CHILDREN_TABLE_SIZE, CHILD_ALIVE_TIMEOUT);
+ADDR_TABLE(topology, TOPO_TABLE_SIZE, 3 * TOPO_REPORT_INTERVAL);
+static uint8_t topo_depth[TOPO_TABLE_SIZE];
+static uint8_t topo_load[TOPO_TABLE_SIZE];
+
+typedef struct m_reading {
+    int16_t value;
+    uint16_t time;
+} m_reading_t;
+
+ADDR_TABLE(readings, READINGS_TABLE_SIZE, READING_TIMEOUT);
+static m_reading_t reading_history[READINGS_TABLE_SIZE][READING_HISTORY];
+static uint8_t reading_head[READINGS_TABLE_SIZE];
+static uint8_t reading_count[READINGS_TABLE_SIZE];
+static uint8_t reading_cat[READINGS_TABLE_SIZE];
+
+static const uint16_t latency_bounds[LATENCY_BUCKETS - 1] = { 10, 20, 50, 100, 200, 500, 1000, 2000, 5000 };
+static uint16_t latency_hist[LGT_BLB + 1][LATENCY_BUCKETS];
+static uint16_t hop_hist[LGT_BLB + 1][HOP_BUCKETS];
+
+typedef struct m_node_stats {
+    uint8_t rank;
+    uint8_t children;
+    uint16_t parent_changes;
+    uint8_t records;  /* in the whole answer */
+    uint8_t received;
+    uint8_t queue_peak;
+    uint16_t queue_drops;
+    uint16_t counters[NB_MSGCAT][NB_STATS];
+} m_node_stats_t;
+
+ADDR_TABLE(stats_pending, STATS_PENDING_SIZE, STATS_PENDING_TIMEOUT);
+static m_node_stats_t node_stats[STATS_PENDING_SIZE];
+
+static int query_active;
+static int query_since;
+static int query_slot;
+static int query_entry;
+static uint16_t query_sent;
 
-static struct ctimer timer;
-static struct ctimer init_children_alive_timer;
 static struct ctimer children_alive_timer;
+static struct ctimer topology_timer;
+
+typedef enum m_cmd_state { CMD_FREE, CMD_DEFERRED, CMD_IN_FLIGHT, CMD_ACTIVE } m_cmd_state_t;
+
+typedef struct m_pending {
+    uint8_t state;
+    m_appcat_t appcat;
+    int value;
+    linkaddr_t target;
+    uint8_t attempts;
+    uint8_t seqs[CMD_MAX_ATTEMPTS];
+    uint8_t extended; /* value grew since the last transmission */
+    clock_time_t sent_at;
+    struct ctimer timer;
+} m_pending_t;
+
+static m_pending_t pending[CMD_PENDING_SIZE];
+static uint16_t cmd_merged;
+static uint16_t cmd_deferred;
+
+typedef struct m_bucket {
+    uint8_t tokens;
+    clock_time_t refilled;
+} m_bucket_t;
+
+ADDR_TABLE(cmd_targets, CMD_BUCKETS_SIZE, 4 * CMD_TARGET_PERIOD * CMD_TARGET_BURST);
+static m_bucket_t target_buckets[CMD_BUCKETS_SIZE];
+static m_bucket_t global_bucket = { CMD_GLOBAL_BURST, 0 };
+
+static uint8_t serial_tx_ring[SERIAL_TX_BUF_SIZE];
+static uint16_t serial_tx_head;
+static uint16_t serial_tx_tail;
+static uint16_t serial_tx_drops;
+static uint16_t serial_tx_reported_drops;
+
+#if SERIAL_BINARY
+static struct ctimer serial_flush_timer;
+static uint8_t serial_tx_frame[SERIAL_FRAME_MAX];
+static int serial_tx_len;
+static int serial_tx_count;
+static uint8_t serial_rx_buf[SERIAL_FRAME_MAX];
+static int serial_rx_len;
+static int serial_rx_escaped;
+static uint8_t serial_rx_frame[SERIAL_FRAME_MAX];
+static volatile int serial_rx_frame_len;
+#endif
 
 static char* serv_token = "[2serv]";
 static char* clie_token = "[2clie]";
 
 /*---------------------------------------------------------------------------*/
 PROCESS(gateway_process, "Gateway process");
-AUTOSTART_PROCESSES(&gateway_process);
+PROCESS(serial_tx_process, "Serial TX process");
+AUTOSTART_PROCESSES(&gateway_process, &serial_tx_process);
 /*---------------------------------------------------------------------------*/
 
-static void send_hello_message(void* ptr) {
-  ctimer_reset(&timer);
-  m_packet_t msg = encode_message(GATEWAY, HELLO);
-  nullnet_buf = (uint8_t *)(&msg);
-  nullnet_len = sizeof(m_packet_t);
-  NETSTACK_NETWORK.output(NULL);
+static int serial_tx_free(void) {
+  return SERIAL_TX_BUF_SIZE - (uint16_t)(serial_tx_head - serial_tx_tail);
+}
+
+static int serial_write(const uint8_t *data, int len) {
+  if (len + 2 > serial_tx_free()) {
+    serial_tx_drops++;
+    return 0;
+  }
+
+  serial_tx_ring[serial_tx_head++ & (SERIAL_TX_BUF_SIZE - 1)] = len & 0xff;
+  serial_tx_ring[serial_tx_head++ & (SERIAL_TX_BUF_SIZE - 1)] = len >> 8;
+  for (int i = 0; i < len; i++) {
+    serial_tx_ring[serial_tx_head++ & (SERIAL_TX_BUF_SIZE - 1)] = data[i];
+  }
+  process_poll(&serial_tx_process);
+  return 1;
 }
 
 static void check_children_alive(void* ptr) {
-  for (int i = 0; i < nb_dead_children; i++) {
-    for (int j = 0; j < nb_children; j++) {
-      if (linkaddr_cmp(&dead_children[i], &children[j]) != 0) {
-        nb_children = remove_linkaddr(&children, nb_children, &children[j]);
-        j--;
-      }
+  ctimer_reset(&children_alive_timer);
+  if (addr_table_expire(&children, route_purge) > 0) {
+    log_children(&children);
+    hello_inconsistent();
+  }
+  route_expire();
+}
+
+#if SERIAL_BINARY
+static int slip_encode(uint8_t *out, uint8_t c) {
+  if (c == SLIP_END) {
+    out[0] = SLIP_ESC;
+    out[1] = SLIP_ESC_END;
+    return 2;
+  } else if (c == SLIP_ESC) {
+    out[0] = SLIP_ESC;
+    out[1] = SLIP_ESC_ESC;
+    return 2;
+  }
+  out[0] = c;
+  return 1;
+}
+
+static void serial_flush(void *ptr) {
+  if (serial_tx_count == 0)
+    return;
+  serial_tx_frame[1] = serial_tx_count;
+  uint16_t crc = crc16_data(serial_tx_frame, serial_tx_len, 0);
+
+  uint8_t out[SERIAL_RECORD_MAX];
+  int len = 0;
+  out[len++] = SLIP_END;
+  for (int i = 0; i < serial_tx_len; i++) {
+    len += slip_encode(&out[len], serial_tx_frame[i]);
+  }
+  len += slip_encode(&out[len], crc & 0xff);
+  len += slip_encode(&out[len], crc >> 8);
+  out[len++] = SLIP_END;
+  serial_write(out, len);
+
+  serial_tx_len = 0;
+  serial_tx_count = 0;
+}
+
+static void serial_put_record(const m_packet_t *packet, const int *extra, int nb_extra) {
+  int record_len = SERIAL_RECORD_LEN + 2 * nb_extra;
+  if (serial_tx_len + record_len + 2 > SERIAL_FRAME_MAX)
+    serial_flush(NULL);
+  if (serial_tx_count == 0) {
+    serial_tx_frame[0] = SERIAL_FRAME_RECORDS;
+    serial_tx_len = 2;
+    ctimer_set(&serial_flush_timer, SERIAL_FLUSH_DELAY, serial_flush, NULL);
+  }
+
+  uint8_t *record = &serial_tx_frame[serial_tx_len];
+  record[0] = record_len;
+  record[1] = packet->rank;
+  record[2] = packet->msgcat;
+  record[3] = packet->appcat;
+  record[4] = (uint16_t) packet->value & 0xff;
+  record[5] = (uint16_t) packet->value >> 8;
+  memcpy(&record[6], packet->src.u8, LINKADDR_SIZE);
+  for (int i = 0; i < nb_extra; i++) {
+    record[SERIAL_RECORD_LEN + 2 * i] = (uint16_t) extra[i] & 0xff;
+    record[SERIAL_RECORD_LEN + 2 * i + 1] = (uint16_t) extra[i] >> 8;
+  }
+  serial_tx_len += record_len;
+  serial_tx_count++;
+}
+
+static int serial_rx_byte(unsigned char c) {
+  // runs from the UART interrupt: only reassemble, the process decodes
+  if (c == SLIP_END) {
+    if (serial_rx_len > 0 && serial_rx_frame_len == 0) {
+      memcpy(serial_rx_frame, serial_rx_buf, serial_rx_len);
+      serial_rx_frame_len = serial_rx_len;
+      process_poll(&gateway_process);
+    }
+    serial_rx_len = 0;
+    serial_rx_escaped = 0;
+    return 1;
+  }
+  if (c == SLIP_ESC) {
+    serial_rx_escaped = 1;
+    return 1;
+  }
+  if (serial_rx_escaped) {
+    c = c == SLIP_ESC_END ? SLIP_END : SLIP_ESC;
+    serial_rx_escaped = 0;
+  }
+  if (serial_rx_len < SERIAL_FRAME_MAX)
+    serial_rx_buf[serial_rx_len++] = c;
+  return 1;
+}
+#endif
+
+#define ADDR_FMT "%02x%02x.%02x%02x.%02x%02x.%02x%02x"
+#define ADDR_ARGS(a) (a).u8[0], (a).u8[1], (a).u8[2], (a).u8[3], (a).u8[4], (a).u8[5], (a).u8[6], (a).u8[7]
+
+static void send_to_server(const m_packet_t *packet) {
+#if SERIAL_BINARY
+  serial_put_record(packet, NULL, 0);
+#else
+  char line[SERIAL_RECORD_MAX];
+  int len = snprintf(line, sizeof(line), "%s{\"rank\":%d,\"msgcat\":%d,\"appcat\":%d,\"value\":%d,\"src\":\"" ADDR_FMT "\"}\n",
+    serv_token, packet->rank, packet->msgcat, packet->appcat, packet->value, ADDR_ARGS(packet->src));
+  serial_write((uint8_t *) line, len);
+#endif
+}
+
+static void send_agg_to_server(const m_packet_t *packet) {
+  int extra[3] = { agg_field(packet, 0), agg_field(packet, 1), agg_field(packet, 2) };
+#if SERIAL_BINARY
+  serial_put_record(packet, extra, 3);
+#else
+  char line[SERIAL_RECORD_MAX];
+  int len = snprintf(line, sizeof(line), "%s{\"rank\":%d,\"msgcat\":%d,\"appcat\":%d,\"value\":%d,\"min\":%d,\"max\":%d,\"mean\":%d,\"src\":\"" ADDR_FMT "\"}\n",
+    serv_token, packet->rank, packet->msgcat, packet->appcat, packet->value, extra[0], extra[1], extra[2], ADDR_ARGS(packet->src));
+  serial_write((uint8_t *) line, len);
+#endif
+}
+
+static void send_status_to_server(const m_pending_t *cmd, int status) {
+  m_packet_t packet = new_app_message(GATEWAY, APP_CMD_ACK, status);
+  set_packet_src(&packet, &cmd->target);
+  int extra[2] = { cmd->appcat, cmd->attempts };
+#if SERIAL_BINARY
+  serial_put_record(&packet, extra, 2);
+#else
+  char line[SERIAL_RECORD_MAX];
+  int len = snprintf(line, sizeof(line), "%s{\"rank\":%d,\"msgcat\":%d,\"appcat\":%d,\"value\":%d,\"cmd\":%d,\"attempts\":%d,\"src\":\"" ADDR_FMT "\"}\n",
+    serv_token, packet.rank, packet.msgcat, packet.appcat, packet.value, extra[0], extra[1], ADDR_ARGS(packet.src));
+  serial_write((uint8_t *) line, len);
+#endif
+}
+
+static void send_energy_to_server(const m_packet_t *packet) {
+  int records = packet->payload_len >= ENERGY_HEADER_LEN ? (packet->payload_len - ENERGY_HEADER_LEN) / ENERGY_RECORD_LEN : 0;
+  int extra[6];
+#if SERIAL_BINARY
+  m_packet_t record = *packet;
+  record.value = -1;
+  for (int i = 0; i < 3; i++) {
+    extra[i] = energy_field(packet, -1, i);
+  }
+  serial_put_record(&record, extra, 3);
+  for (int r = 0; r < records; r++) {
+    record.value = energy_field(packet, r, 0);
+    for (int i = 0; i < 6; i++) {
+      extra[i] = energy_field(packet, r, i + 1);
+    }
+    serial_put_record(&record, extra, 6);
+  }
+#else
+  char line[ENERGY_LINE_MAX];
+  int len = snprintf(line, sizeof(line), "%s{\"rank\":%d,\"msgcat\":%d,\"appcat\":%d,\"value\":%d,\"duty\":[%d,%d,%d],\"classes\":[",
+    serv_token, packet->rank, packet->msgcat, packet->appcat, packet->value,
+    energy_field(packet, -1, 0), energy_field(packet, -1, 1), energy_field(packet, -1, 2));
+  for (int r = 0; r < records && len < (int)sizeof(line); r++) {
+    for (int i = 0; i < 6; i++) {
+      extra[i] = energy_field(packet, r, i + 1);
+    }
+    len += snprintf(&line[len], sizeof(line) - len, "%s[%d,%d,%d,%d,%d,%d,%d]", r > 0 ? "," : "",
+      energy_field(packet, r, 0), extra[0], extra[1], extra[2], extra[3], extra[4], extra[5]);
+  }
+  if (len < (int)sizeof(line))
+    len += snprintf(&line[len], sizeof(line) - len, "],\"src\":\"" ADDR_FMT "\"}\n", ADDR_ARGS(packet->src));
+  if (len < (int)sizeof(line))
+    serial_write((uint8_t *) line, len);
+#endif
+}
+
+static void send_reading_to_server(const m_packet_t *packet, int age, int time, int cat) {
+  int extra[3] = { age, time, cat };
+#if SERIAL_BINARY
+  serial_put_record(packet, extra, 3);
+#else
+  char line[SERIAL_RECORD_MAX];
+  int len = snprintf(line, sizeof(line), "%s{\"rank\":%d,\"msgcat\":%d,\"appcat\":%d,\"value\":%d,\"age\":%d,\"t\":%d,\"cat\":%d,\"src\":\"" ADDR_FMT "\"}\n",
+    serv_token, packet->rank, packet->msgcat, packet->appcat, packet->value, extra[0], extra[1], extra[2], ADDR_ARGS(packet->src));
+  serial_write((uint8_t *) line, len);
+#endif
+}
+
+static void send_traced_to_server(const m_packet_t *packet, int cat) {
+  int extra[4] = { trace_latency(packet), packet->trace.hops + 1, packet->trace.origin, cat };
+#if SERIAL_BINARY
+  serial_put_record(packet, extra, 4);
+#else
+  char line[SERIAL_RECORD_MAX];
+  int len = snprintf(line, sizeof(line), "%s{\"rank\":%d,\"msgcat\":%d,\"appcat\":%d,\"value\":%d,\"lat\":%d,\"hops\":%d,\"t0\":%u,\"cat\":%d,\"src\":\"" ADDR_FMT "\"}\n",
+    serv_token, packet->rank, packet->msgcat, packet->appcat, packet->value, extra[0], extra[1], (uint16_t) extra[2], extra[3], ADDR_ARGS(packet->src));
+  serial_write((uint8_t *) line, len);
+#endif
+}
+
+static void send_latency_to_server(int cat) {
+  m_packet_t record = new_app_message(GATEWAY, APP_LATENCY, cat);
+  set_packet_src(&record, &linkaddr_node_addr);
+  int extra[LATENCY_BUCKETS + HOP_BUCKETS];
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    extra[i] = latency_hist[cat][i];
+  }
+  for (int i = 0; i < HOP_BUCKETS; i++) {
+    extra[LATENCY_BUCKETS + i] = hop_hist[cat][i];
+  }
+#if SERIAL_BINARY
+  serial_put_record(&record, extra, LATENCY_BUCKETS + HOP_BUCKETS);
+#else
+  char line[LATENCY_LINE_MAX];
+  int len = snprintf(line, sizeof(line), "%s{\"rank\":%d,\"msgcat\":%d,\"appcat\":%d,\"value\":%d,\"latency\":[",
+    serv_token, record.rank, record.msgcat, record.appcat, record.value);
+  for (int i = 0; i < LATENCY_BUCKETS + HOP_BUCKETS && len < (int)sizeof(line); i++) {
+    len += snprintf(&line[len], sizeof(line) - len, "%s%u", i == LATENCY_BUCKETS ? "],\"hops\":[" : i > 0 ? "," : "", (uint16_t) extra[i]);
+  }
+  if (len < (int)sizeof(line))
+    len += snprintf(&line[len], sizeof(line) - len, "],\"src\":\"" ADDR_FMT "\"}\n", ADDR_ARGS(record.src));
+  if (len < (int)sizeof(line))
+    serial_write((uint8_t *) line, len);
+#endif
+}
+
+static void latency_sample(const m_packet_t *reading, int cat) {
+  int latency = trace_latency(reading);
+  if (latency < 0 || cat > LGT_BLB)
+    return;
+  int bucket = 0;
+  while (bucket < LATENCY_BUCKETS - 1 && latency > latency_bounds[bucket])
+    bucket++;
+  int hops = reading->trace.hops + 1 < HOP_BUCKETS ? reading->trace.hops + 1 : HOP_BUCKETS - 1;
+  if (latency_hist[cat][bucket] < 0xffff)
+    latency_hist[cat][bucket]++;
+  if (hop_hist[cat][hops] < 0xffff)
+    hop_hist[cat][hops]++;
+}
+
+static void dump_latency(int reset) {
+  int sent = 0;
+  for (int cat = 0; cat <= LGT_BLB; cat++) {
+    uint32_t samples = 0;
+    for (int i = 0; i < HOP_BUCKETS; i++) {
+      samples += hop_hist[cat][i];
+    }
+    if (samples == 0)
+      continue;
+    send_latency_to_server(cat);
+    sent++;
+  }
+  LOG_INFO("Latency histograms sent for %d categories\n", sent);
+  if (reset) {
+    memset(latency_hist, 0, sizeof(latency_hist));
+    memset(hop_hist, 0, sizeof(hop_hist));
+  }
+}
+
+static void send_stats_to_server(int slot) {
+  const m_node_stats_t *entry = &node_stats[slot];
+  m_packet_t record = new_app_message(entry->rank, APP_STATS, entry->children);
+  set_packet_src(&record, addr_table_get(&stats_pending, slot));
+  int extra[3 + NB_MSGCAT * NB_STATS];
+  extra[0] = entry->parent_changes;
+  extra[1] = entry->queue_peak;
+  extra[2] = entry->queue_drops;
+  for (int i = 0; i < NB_MSGCAT; i++) {
+    for (int j = 0; j < NB_STATS; j++) {
+      extra[3 + i * NB_STATS + j] = entry->counters[i][j];
+    }
+  }
+#if SERIAL_BINARY
+  serial_put_record(&record, extra, 3 + NB_MSGCAT * NB_STATS);
+#else
+  char line[STATS_LINE_MAX];
+  int len = snprintf(line, sizeof(line), "%s{\"rank\":%d,\"msgcat\":%d,\"appcat\":%d,\"value\":%d,\"parent_changes\":%u,\"queue_peak\":%u,\"queue_drops\":%u,\"counters\":[",
+    serv_token, record.rank, record.msgcat, record.appcat, record.value, entry->parent_changes, entry->queue_peak, entry->queue_drops);
+  for (int i = 0; i < NB_MSGCAT * NB_STATS && len < (int)sizeof(line); i++) {
+    len += snprintf(&line[len], sizeof(line) - len, "%s%u", i == 0 ? "[" : i % NB_STATS == 0 ? "],[" : ",", (uint16_t) extra[3 + i]);
+  }
+  if (len < (int)sizeof(line))
+    len += snprintf(&line[len], sizeof(line) - len, "]],\"src\":\"" ADDR_FMT "\"}\n", ADDR_ARGS(record.src));
+  if (len < (int)sizeof(line))
+    serial_write((uint8_t *) line, len);
+#endif
+}
+
+static void stats_received(const m_packet_t *packet) {
+  if (packet->payload_len < STATS_HEADER_LEN)
+    return;
+  int slot = addr_table_touch(&stats_pending, &packet->src);
+  if (slot == -1) {
+    addr_table_expire(&stats_pending, NULL);
+    slot = addr_table_add(&stats_pending, &packet->src);
+    if (slot == -1) {
+      LOG_WARN("Stats from " ADDR_FMT " dropped, %u answers pending\n", ADDR_ARGS(packet->src), stats_pending.count);
+      return;
+    }
+    memset(&node_stats[slot], 0, sizeof(node_stats[slot]));
+  }
+  m_node_stats_t *entry = &node_stats[slot];
+  entry->rank = packet->rank;
+  entry->children = stats_field(packet, -1, 0);
+  entry->parent_changes = stats_field(packet, -1, 1);
+  entry->records = stats_field(packet, -1, 2);
+  entry->queue_peak = stats_field(packet, -1, 3);
+  entry->queue_drops = stats_field(packet, -1, 4);
+  int records = (packet->payload_len - STATS_HEADER_LEN) / STATS_RECORD_LEN;
+  for (int r = 0; r < records; r++) {
+    int msgcat = stats_field(packet, r, 0);
+    if (msgcat >= NB_MSGCAT)
+      continue;
+    for (int i = 0; i < NB_STATS; i++) {
+      entry->counters[msgcat][i] = stats_field(packet, r, i + 1);
+    }
+    entry->received++;
+  }
+  if (entry->received >= entry->records) {
+    send_stats_to_server(slot);
+    addr_table_remove(&stats_pending, &packet->src);
+  }
+}
+
+static void request_stats(void) {
+  // answers to an earlier request are not mixed with the new ones
+  for (int i = 0; i < stats_pending.size; i++) {
+    const linkaddr_t *addr = addr_table_get(&stats_pending, i);
+    if (addr != NULL) {
+      linkaddr_t node = *addr;
+      addr_table_remove(&stats_pending, &node);
+    }
+  }
+  m_packet_t msg = new_app_message(GATEWAY, APP_STATS, 0);
+  set_packet_origin(&msg);
+  int sent = flood_packet(&msg, &children, NULL);
+  LOG_INFO("Stats request sent down in %d frame(s)\n", sent);
+
+  m_packet_t report;
+  int cursor = 0;
+  while (stats_report(&report, &cursor))
+    stats_received(&report);
+}
+
+static int reading_time(void) {
+  return clock_seconds() & READING_TIME_MASK;
+}
+
+static void reading_received(const m_packet_t *reading, m_sensor_t cat) {
+  int slot = addr_table_touch(&readings, &reading->src);
+  if (slot == -1) {
+    addr_table_expire(&readings, NULL);
+    slot = addr_table_add(&readings, &reading->src);
+    if (slot != -1) {
+      reading_head[slot] = 0;
+      reading_count[slot] = 0;
     }
   }
-  free(dead_children);
-  ctimer_reset(&init_children_alive_timer);
+  if (slot != -1) {
+    m_reading_t *entry = &reading_history[slot][reading_head[slot]];
+    entry->value = reading->value;
+    entry->time = reading_time();
+    reading_head[slot] = (reading_head[slot] + 1) % READING_HISTORY;
+    if (reading_count[slot] < READING_HISTORY)
+      reading_count[slot]++;
+    reading_cat[slot] = cat;
+  }
+  if (reading->flags & PKT_FLAG_TRACE) {
+    latency_sample(reading, cat);
+    send_traced_to_server(reading, cat);
+  } else {
+    send_to_server(reading);
+  }
 }
 
-static void init_check_children_alive(void* ptr) {
-  nb_dead_children = nb_children;
-  dead_children = (linkaddr_t*) malloc(nb_dead_children * sizeof(linkaddr_t));
-  for (int i = 0; i < nb_dead_children; i++) {
-    dead_children[i] = children[i];
+// i-th reading of a sensor, oldest first
+static const m_reading_t *cached_reading(int slot, int i) {
+  return &reading_history[slot][(reading_head[slot] + READING_HISTORY - reading_count[slot] + i) % READING_HISTORY];
+}
+
+static void send_cached_reading(int slot, const m_reading_t *entry) {
+  m_packet_t reading = new_app_message(SENSOR, reading_cat[slot] == IRG_SYS ? APP_IRG_ACK : APP_LGT_LVL, entry->value);
+  set_packet_src(&reading, addr_table_get(&readings, slot));
+  send_reading_to_server(&reading, (reading_time() - entry->time) & READING_TIME_MASK, entry->time, reading_cat[slot]);
+}
+
+static void answer_query(const linkaddr_t *target) {
+  addr_table_expire(&readings, NULL);
+  int slot = addr_table_find(&readings, target);
+  if (slot == -1) {
+    LOG_INFO("No reading for " ADDR_FMT "\n", ADDR_ARGS(*target));
+    return;
+  }
+  send_cached_reading(slot, cached_reading(slot, reading_count[slot] - 1));
+}
+
+// sends what fits in the serial buffer, called again as it drains
+static void query_continue(void) {
+  while (query_active && serial_tx_free() >= SERIAL_RECORD_MAX) {
+    if (query_slot == readings.size) {
+      m_packet_t end = new_app_message(GATEWAY, APP_LGT_LVL, query_sent);
+      send_reading_to_server(&end, 0, reading_time(), NO_CAT);
+      query_active = 0;
+      return;
+    }
+    int slot = query_slot;
+    if (addr_table_get(&readings, slot) == NULL || query_entry >= reading_count[slot]) {
+      query_slot++;
+      query_entry = 0;
+      continue;
+    }
+    if (query_since == QUERY_SNAPSHOT && query_entry < reading_count[slot] - 1)
+      query_entry = reading_count[slot] - 1;
+    const m_reading_t *entry = cached_reading(slot, query_entry++);
+    // readings from before the given time are more than half the range away
+    if (query_since != QUERY_SNAPSHOT && ((entry->time - query_since) & READING_TIME_MASK) > READING_TIME_MASK / 2)
+      continue;
+    send_cached_reading(slot, entry);
+    query_sent++;
   }
-  memcpy(dead_children, children, nb_children);
-  ctimer_set(&children_alive_timer, ALIVE_TIMEOUT_INTERVAL, check_children_alive, NULL);
 }
 
-void parse_string(char* str, m_rank_t* rank, m_msgcat_t* msgcat, m_appcat_t* appcat, int* value, linkaddr_t* src) {
+static void start_query(int since) {
+  if (query_active)
+    LOG_INFO("Cache query abandoned after %u readings\n", query_sent);
+  addr_table_expire(&readings, NULL);
+  query_active = 1;
+  query_since = since < 0 ? QUERY_SNAPSHOT : since & READING_TIME_MASK;
+  query_slot = 0;
+  query_entry = 0;
+  query_sent = 0;
+  query_continue();
+}
+
+int parse_string(char* str, m_rank_t* rank, m_msgcat_t* msgcat, m_appcat_t* appcat, int* value, linkaddr_t* src) {
   char* token;
   char* endptr;
-  char temp_str[25];
-  strncpy(temp_str, str, sizeof(temp_str)-1);
-  temp_str[sizeof(temp_str)-1] = '\0';
+  char temp_str[SERIAL_LINE_MAX];
+  if (strlen(str) >= sizeof(temp_str)) {
+    LOG_WARN("Command line too long, ignored\n");
+    return 0;
+  }
+  strcpy(temp_str, str);
   
   token = strtok(temp_str, "|");
   if (token != NULL) *rank = strtol(token, &endptr, 10);
@@ -80,54 +745,356 @@ void parse_string(char* str, m_rank_t* rank, m_msgcat_t* msgcat, m_appcat_t* app
   if (token != NULL) *value = strtol(token, &endptr, 10);
   token = strtok(NULL, "|");
   if (token != NULL) {
+    // "xxxx.xxxx.xxxx.xxxx", two hex digits per byte
     for (int i = 0; i < LINKADDR_SIZE; i++) {
+      if (*token == '.')
+        token++;
       char hex_byte[3];
-      hex_byte[0] = token[2 * i];
-      hex_byte[1] = token[2 * i + 1];
+      hex_byte[0] = token[0];
+      hex_byte[1] = token[0] != '\0' ? token[1] : '\0';
       hex_byte[2] = '\0';
       src->u8[i] = (unsigned char)strtol(hex_byte, NULL, 16);
+      if (hex_byte[1] != '\0')
+        token += 2;
     }
   }
+  return 1;
 }
 
-void input_callback(const void *data, uint16_t len, const linkaddr_t *src, const linkaddr_t *dest) {
-  m_packet_t dmsg = *(m_packet_t*) data;
+// returns how long until the bucket has a token again, 0 if it has one
+static clock_time_t bucket_wait(m_bucket_t *bucket, clock_time_t period, uint8_t burst) {
+  clock_time_t now = clock_time();
+  int added = (now - bucket->refilled) / period;
+  if (bucket->tokens + added >= burst) {
+    bucket->tokens = burst;
+    bucket->refilled = now;
+  } else if (added > 0) {
+    bucket->tokens += added;
+    bucket->refilled += added * period;
+  }
+  return bucket->tokens > 0 ? 0 : bucket->refilled + period - now;
+}
 
-  if (dmsg.msgcat == HELLO) {
-    // remove child from dead children if it's alive
-    nb_dead_children = remove_linkaddr(&dead_children, nb_dead_children, src);
+static clock_time_t take_token(const linkaddr_t *target) {
+  m_bucket_t *bucket = NULL;
+  int slot = addr_table_touch(&cmd_targets, target);
+  if (slot == -1) {
+    addr_table_expire(&cmd_targets, NULL);
+    slot = addr_table_add(&cmd_targets, target);
+    if (slot != -1) {
+      target_buckets[slot].tokens = CMD_TARGET_BURST;
+      target_buckets[slot].refilled = clock_time();
+    }
+  }
+  if (slot != -1)
+    bucket = &target_buckets[slot];
+
+  clock_time_t wait = bucket_wait(&global_bucket, CMD_GLOBAL_PERIOD, CMD_GLOBAL_BURST);
+  if (bucket != NULL) {
+    clock_time_t target_wait = bucket_wait(bucket, CMD_TARGET_PERIOD, CMD_TARGET_BURST);
+    wait = target_wait > wait ? target_wait : wait;
   }
+  if (wait > 0)
+    return wait;
+  global_bucket.tokens--;
+  if (bucket != NULL)
+    bucket->tokens--;
+  return 0;
+}
+
+static void command_timeout(void *ptr);
+
+static void command_expired(void *ptr) {
+  m_pending_t *cmd = ptr;
+  cmd->state = CMD_FREE;
+}
+
+static clock_time_t command_end(const m_pending_t *cmd) {
+  return cmd->sent_at + cmd->value * CLOCK_SECOND;
+}
+
+static void send_command(m_pending_t *cmd) {
+  m_packet_t msg = new_app_message(GATEWAY, cmd->appcat, cmd->value);
+  set_packet_origin(&msg);
+  cmd->state = CMD_IN_FLIGHT;
+  cmd->extended = 0;
+  cmd->sent_at = clock_time();
+  cmd->seqs[cmd->attempts++] = msg.seq;
+  int sent;
+  if (cmd->appcat == APP_LGT_ON) {
+    set_packet_dst(&msg, &cmd->target);
+    sent = send_packet_down(&msg, &children, NULL);
+  } else {
+    sent = flood_packet(&msg, &children, NULL);
+  }
+  LOG_INFO("Command %d sent down in %d frame(s)\n", cmd->appcat, sent);
+  ctimer_set(&cmd->timer, CMD_ACK_TIMEOUT << (cmd->attempts - 1), command_timeout, cmd);
+}
+
+static void command_timeout(void *ptr) {
+  m_pending_t *cmd = ptr;
+  if (cmd->attempts < CMD_MAX_ATTEMPTS) {
+    send_command(cmd);
+    return;
+  }
+  LOG_INFO("Command %d to " ADDR_FMT " failed after %u attempts\n", cmd->appcat, ADDR_ARGS(cmd->target), cmd->attempts);
+  send_status_to_server(cmd, CMD_FAILED);
+  cmd->state = CMD_FREE;
+}
+
+static void command_deferred(void *ptr) {
+  m_pending_t *cmd = ptr;
+  clock_time_t wait = take_token(&cmd->target);
+  if (wait > 0)
+    ctimer_set(&cmd->timer, wait, command_deferred, cmd);
+  else
+    send_command(cmd);
+}
+
+static void issue_command(m_pending_t *cmd) {
+  clock_time_t wait = take_token(&cmd->target);
+  if (wait == 0) {
+    send_command(cmd);
+    return;
+  }
+  cmd->state = CMD_DEFERRED;
+  cmd->sent_at = clock_time();
+  ctimer_set(&cmd->timer, wait, command_deferred, cmd);
+  LOG_INFO("Command %d to " ADDR_FMT " deferred, %u deferred so far\n", cmd->appcat, ADDR_ARGS(cmd->target), ++cmd_deferred);
+}
+
+static void command_acked(const linkaddr_t *from, int seq) {
+  for (int i = 0; i < CMD_PENDING_SIZE; i++) {
+    m_pending_t *cmd = &pending[i];
+    if (cmd->state != CMD_IN_FLIGHT)
+      continue;
+    if (cmd->appcat == APP_LGT_ON && linkaddr_cmp(from, &cmd->target) == 0)
+      continue;
+    // best effort for the broadcast APP_IRG_ON: the gateway does not know
+    // the irrigation systems, so the first ACK marks it delivered
+    for (int j = 0; j < cmd->attempts; j++) {
+      if (cmd->seqs[j] == seq) {
+        // the target only got the shorter duration
+        if (cmd->extended && cmd->attempts < CMD_MAX_ATTEMPTS) {
+          send_command(cmd);
+          return;
+        }
+        send_status_to_server(cmd, CMD_DELIVERED);
+        // kept while in effect so that repeated requests get merged
+        cmd->state = CMD_ACTIVE;
+        clock_time_t end = command_end(cmd) + CMD_COALESCE_WINDOW;
+        ctimer_set(&cmd->timer, end > clock_time() ? end - clock_time() : 1, command_expired, cmd);
+        return;
+      }
+    }
+  }
+}
+
+void input_callback(const void *data, uint16_t len, const linkaddr_t *src, const linkaddr_t *dest) {
+  m_packet_t dmsg;
+  if (!receive_packet(data, len, &dmsg)) {
+    LOG_WARN("Dropping malformed packet (%u bytes)\n", len);
+    return;
+  }
+
+  // any frame from a child proves it is still alive
+  int child_slot = addr_table_touch(&children, src);
+  // upward traffic tells which child leads to its origin
+  if (dmsg.msgcat == APPLICATION && dmsg.flags & PKT_FLAG_SRC && linkaddr_cmp(dest, &linkaddr_null) == 0)
+    route_learn(&dmsg.src, child_slot);
+  flood_overhear(&dmsg, child_slot);
 
   if (dmsg.msgcat == HELLO_ACK) {
-    nb_children = add_linkaddr(&children, nb_children, src);
+    int slot = addr_table_find(&children, src);
+    if (slot == -1) {
+      slot = addr_table_add(&children, src);
+      hello_inconsistent();
+    }
+    child_advertised(slot, &dmsg);
     linkaddr_t src_copy;
     linkaddr_copy(&src_copy, src);
   }
 
   else if (dmsg.msgcat == CHILD_DISCONNECT) {
-    nb_children = remove_linkaddr(&children, nb_children, src);
+    int slot = addr_table_remove(&children, src);
+    if (slot != -1) {
+      route_purge(slot);
+      hello_inconsistent();
+    }
   }
 
   else if (dmsg.msgcat == APPLICATION) {
+    if (packet_seen(&dmsg))
+      return;
     if (dmsg.appcat == APP_LGT_LVL) {
-      linkaddr_copy(&dmsg.src, src); // simple NAT
-      printf("%s", serv_token);
-      printf("{\"rank\":%d,", dmsg.rank);
-      printf("\"msgcat\":%d,", dmsg.msgcat);
-      printf("\"appcat\":%d,", dmsg.appcat);
-      printf("\"value\":%d,", dmsg.value);
-      printf("\"src\":\"%02u%02u.%02u%02u.%02u%02u.%02u%02u\"}\n", src->u8[0], src->u8[1], src->u8[2], src->u8[3], src->u8[4], src->u8[5], src->u8[6], src->u8[7]);
+      if (!(dmsg.flags & PKT_FLAG_SRC))
+        set_packet_src(&dmsg, src); // simple NAT
+      reading_received(&dmsg, LGT_SEN);
+    } else if (dmsg.appcat == APP_LGT_BATCH) {
+      // unpack the subgateway batch into one reading per sensor
+      linkaddr_t origin;
+      int value;
+      for (int i = 0; batch_record(&dmsg, i, &origin, &value); i++) {
+        route_learn(&origin, child_slot);
+        m_packet_t reading = new_app_message(SENSOR, APP_LGT_LVL, value);
+        set_packet_src(&reading, &origin);
+        if (dmsg.flags & PKT_FLAG_TRACE) {
+          reading.flags |= PKT_FLAG_TRACE;
+          reading.trace = dmsg.trace;
+          reading.received = dmsg.received;
+        }
+        reading_received(&reading, LGT_SEN);
+      }
+    } else if (dmsg.appcat == APP_LGT_AGG) {
+      latency_sample(&dmsg, LGT_SEN);
+      send_agg_to_server(&dmsg);
     } else if (dmsg.appcat == APP_IRG_ACK) {
-      printf("%s", serv_token);
-      printf("{\"rank\":%d,", dmsg.rank);
-      printf("\"msgcat\":%d,", dmsg.msgcat);
-      printf("\"appcat\":%d,", dmsg.appcat);
-      printf("\"value\":%d,", dmsg.value);
-      printf("\"src\":\"%02u%02u.%02u%02u.%02u%02u.%02u%02u\"}\n", dmsg.src.u8[0], dmsg.src.u8[1], dmsg.src.u8[2], dmsg.src.u8[3], dmsg.src.u8[4], dmsg.src.u8[5], dmsg.src.u8[6], dmsg.src.u8[7]);
+      if (!(dmsg.flags & PKT_FLAG_SRC))
+        set_packet_src(&dmsg, src);
+      reading_received(&dmsg, IRG_SYS);
+    } else if (dmsg.appcat == APP_CMD_ACK && dmsg.flags & PKT_FLAG_SRC) {
+      command_acked(&dmsg.src, dmsg.value);
+    } else if (dmsg.appcat == APP_ENERGY && dmsg.flags & PKT_FLAG_SRC) {
+      send_energy_to_server(&dmsg);
+    } else if (dmsg.appcat == APP_STATS && dmsg.flags & PKT_FLAG_SRC && dmsg.flags & PKT_FLAG_PAYLOAD) {
+      stats_received(&dmsg);
+    } else if (dmsg.appcat == APP_TOPO && dmsg.flags & PKT_FLAG_SRC) {
+      int slot = addr_table_touch(&topology, &dmsg.src);
+      if (slot == -1)
+        slot = addr_table_add(&topology, &dmsg.src);
+      if (slot != -1) {
+        topo_depth[slot] = TOPO_DEPTH(dmsg.value);
+        topo_load[slot] = TOPO_LOAD(dmsg.value);
+      }
     }
   }
 }
 
+static void log_histogram(const char *name, const uint16_t *hist, int size) {
+  char line[128] = "";
+  int len = 0;
+  for (int i = 0; i < size && len < (int)sizeof(line); i++) {
+    if (hist[i] > 0)
+      len += snprintf(&line[len], sizeof(line) - len, " %d:%u", i, hist[i]);
+  }
+  LOG_INFO("%s (value:nodes)%s\n", name, line);
+}
+
+// fan-out and depth distribution of the tree, from the nodes' reports
+static void report_topology(void *ptr) {
+  ctimer_reset(&topology_timer);
+  addr_table_expire(&topology, NULL);
+
+  uint16_t depths[MAX_DEPTH + 1] = { 0 };
+  uint16_t loads[CHILDREN_TABLE_SIZE + 1] = { 0 };
+  depths[0] = 1;
+  loads[children.count]++;
+  int max_depth = 0;
+  for (int i = 0; i < topology.size; i++) {
+    if (addr_table_get(&topology, i) == NULL)
+      continue;
+    if (topo_depth[i] <= MAX_DEPTH)
+      depths[topo_depth[i]]++;
+    if (topo_load[i] <= CHILDREN_TABLE_SIZE)
+      loads[topo_load[i]]++;
+    if (topo_depth[i] > max_depth && topo_depth[i] != DEPTH_UNKNOWN)
+      max_depth = topo_depth[i];
+  }
+  LOG_INFO("Topology: %u nodes reporting, gateway fan-out %u, max depth %d\n", topology.count, children.count, max_depth);
+  log_histogram("Depth", depths, MAX_DEPTH + 1);
+  log_histogram("Fan-out", loads, CHILDREN_TABLE_SIZE + 1);
+
+  // the gateway's own traffic accounting goes with the nodes' reports
+  m_packet_t report;
+  int cursor = 0;
+  while (energy_report(&report, &cursor))
+    send_energy_to_server(&report);
+}
+
+static void handle_command(m_msgcat_t msgcat, m_appcat_t appcat, int value, const linkaddr_t *target) {
+  if (msgcat == APPLICATION && appcat == APP_LATENCY) {
+    dump_latency(value);
+    return;
+  }
+  if (msgcat == APPLICATION && appcat == APP_STATS) {
+    request_stats();
+    return;
+  }
+  // answered from the gateway's cache, no radio traffic
+  if (msgcat == APPLICATION && appcat == APP_LGT_LVL) {
+    if (linkaddr_cmp(target, &linkaddr_null))
+      start_query(value);
+    else
+      answer_query(target);
+    return;
+  }
+  if (msgcat != APPLICATION || (appcat != APP_LGT_ON && appcat != APP_IRG_ON))
+    return;
+
+  clock_time_t end = clock_time() + value * CLOCK_SECOND;
+  m_pending_t *cmd = NULL;
+  m_pending_t *active = NULL;
+  int in_flight = 0;
+  for (int i = 0; i < CMD_PENDING_SIZE; i++) {
+    m_pending_t *other = &pending[i];
+    if (other->state == CMD_FREE || linkaddr_cmp(&other->target, target) == 0)
+      continue;
+    if (other->state != CMD_ACTIVE)
+      in_flight++;
+    if (other->appcat != appcat)
+      continue;
+    if (other->state != CMD_ACTIVE) {
+      // not delivered yet: make it last as long as both requests
+      if (end > command_end(other)) {
+        other->value = (end - other->sent_at + CLOCK_SECOND - 1) / CLOCK_SECOND;
+        other->extended = other->state == CMD_IN_FLIGHT;
+      }
+      LOG_INFO("Command %d to " ADDR_FMT " merged, %u merged so far\n", appcat, ADDR_ARGS(*target), ++cmd_merged);
+      return;
+    }
+    if (end <= command_end(other) + CMD_COALESCE_WINDOW) {
+      LOG_INFO("Command %d to " ADDR_FMT " merged, %u merged so far\n", appcat, ADDR_ARGS(*target), ++cmd_merged);
+      return;
+    }
+    active = other;
+  }
+  if (in_flight >= CMD_MAX_INFLIGHT) {
+    m_pending_t rejected = { .appcat = appcat, .target = *target };
+    LOG_INFO("Command %d to " ADDR_FMT " rejected, %d in flight\n", appcat, ADDR_ARGS(*target), in_flight);
+    send_status_to_server(&rejected, CMD_REJECTED);
+    return;
+  }
+
+  // a command still in effect but too short is replaced
+  if (active != NULL) {
+    ctimer_stop(&active->timer);
+    cmd = active;
+  }
+  for (int i = 0; i < CMD_PENDING_SIZE && cmd == NULL; i++) {
+    if (pending[i].state == CMD_FREE)
+      cmd = &pending[i];
+  }
+  // commands in effect are only remembered for merging, reuse one
+  for (int i = 0; i < CMD_PENDING_SIZE && cmd == NULL; i++) {
+    if (pending[i].state == CMD_ACTIVE) {
+      ctimer_stop(&pending[i].timer);
+      cmd = &pending[i];
+    }
+  }
+  if (cmd == NULL) {
+    m_pending_t rejected = { .appcat = appcat, .target = *target };
+    LOG_INFO("Command %d to " ADDR_FMT " rejected, pending table full\n", appcat, ADDR_ARGS(*target));
+    send_status_to_server(&rejected, CMD_REJECTED);
+    return;
+  }
+
+  cmd->appcat = appcat;
+  cmd->value = value;
+  cmd->attempts = 0;
+  linkaddr_copy(&cmd->target, target);
+  issue_command(cmd);
+}
+
 PROCESS_THREAD(gateway_process, ev, data) {
 
   PROCESS_BEGIN();
@@ -136,18 +1103,43 @@ PROCESS_THREAD(gateway_process, ev, data) {
   tsch_set_coordinator(linkaddr_cmp(&coordinator_addr, &linkaddr_node_addr));
 #endif /* MAC_CONF_WITH_TSCH */
 
+  init_commons(rank, &children);
   nullnet_set_input_callback(input_callback);
  
-  ctimer_set(&timer, SEND_INTERVAL, send_hello_message, NULL);
-  ctimer_set(&init_children_alive_timer, CLOCK_SECOND, init_check_children_alive, NULL);
+  hello_start();
+  ctimer_set(&children_alive_timer, CHILDREN_SWEEP_INTERVAL, check_children_alive, NULL);
+  ctimer_set(&topology_timer, TOPO_REPORT_INTERVAL, report_topology, NULL);
 
   update_mote_color(in_net, rank, NO_CAT);
 
+#if SERIAL_BINARY
+  uart0_set_input(serial_rx_byte);
+#else
   serial_line_init();
   uart0_set_input(serial_line_input_byte);
+#endif
 
   while(1) {
     PROCESS_YIELD();
+#if SERIAL_BINARY
+    if (ev == PROCESS_EVENT_POLL && serial_rx_frame_len > 0) {
+      int len = serial_rx_frame_len;
+      if (len < 4 || serial_rx_frame[0] != SERIAL_FRAME_COMMANDS
+          || crc16_data(serial_rx_frame, len - 2, 0) != (serial_rx_frame[len - 2] | (serial_rx_frame[len - 1] << 8))) {
+        LOG_WARN("Dropping bad serial frame (%d bytes)\n", len);
+      } else {
+        int pos = 2;
+        for (int i = 0; i < serial_rx_frame[1] && pos + SERIAL_RECORD_LEN <= len - 2; i++) {
+          const uint8_t *record = &serial_rx_frame[pos];
+          linkaddr_t target;
+          memcpy(target.u8, &record[6], LINKADDR_SIZE);
+          handle_command(record[2], record[3], (int16_t) (record[4] | (record[5] << 8)), &target);
+          pos += record[0] > 0 ? record[0] : SERIAL_RECORD_LEN;
+        }
+      }
+      serial_rx_frame_len = 0;
+    }
+#else
     if(ev == serial_line_event_message) {
       if (strncmp((char*) data, clie_token, 7) == 0) {
         char *input_string = &((char*) data)[7];
@@ -156,23 +1148,38 @@ PROCESS_THREAD(gateway_process, ev, data) {
         m_appcat_t appcat;
         int value;
         linkaddr_t src;
-        parse_string(input_string, &rank, &msgcat, &appcat, &value, &src);
-        if (msgcat == APPLICATION) {
-          if (appcat == APP_LGT_ON) {
-            m_packet_t msg = encode_app_message(GATEWAY, appcat, value);
-            nullnet_buf = (uint8_t *)(&msg);
-            nullnet_len = sizeof(m_packet_t);
-            NETSTACK_NETWORK.output(&src);
-          } else if (appcat == APP_IRG_ON) {
-            for (int i = 0; i < nb_children; i++) {
-              m_packet_t msg = encode_app_message(GATEWAY, appcat, value);
-              nullnet_buf = (uint8_t *)(&msg);
-              nullnet_len = sizeof(m_packet_t);
-              NETSTACK_NETWORK.output(&children[i]);
-            }
-          }
-        }
+        if (parse_string(input_string, &rank, &msgcat, &appcat, &value, &src))
+          handle_command(msgcat, appcat, value, &src);
+      }
+    }
+#endif
+  }
+
+  PROCESS_END();
+}
+
+PROCESS_THREAD(serial_tx_process, ev, data) {
+
+  PROCESS_BEGIN();
+
+  while(1) {
+    PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_POLL);
+
+    // one record per round so other processes get to run in between
+    while (serial_tx_head != serial_tx_tail) {
+      uint16_t len = serial_tx_ring[serial_tx_tail++ & (SERIAL_TX_BUF_SIZE - 1)];
+      len |= serial_tx_ring[serial_tx_tail++ & (SERIAL_TX_BUF_SIZE - 1)] << 8;
+      for (int i = 0; i < len; i++) {
+        putchar(serial_tx_ring[serial_tx_tail++ & (SERIAL_TX_BUF_SIZE - 1)]);
       }
+      query_continue();
+      process_poll(&serial_tx_process);
+      PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_POLL);
+    }
+
+    if (serial_tx_drops != serial_tx_reported_drops) {
+      LOG_WARN("Serial TX buffer full, %u records dropped so far\n", serial_tx_drops);
+      serial_tx_reported_drops = serial_tx_drops;
     }
   }
 
@@ -7,31 +7,45 @@
 #include <limits.h>
 #include "sys/node-id.h"
 #include "net/packetbuf.h"
+#include "lib/random.h"
 #include "commons.h"
 #include "dev/uart0.h"
 #include "dev/leds.h"
 
 #define SERIAL_BUF_SIZE 128
 
+/*
+ * In send-on-delta mode (UART 'e', back to periodic with 'p') a light
+ * sensor only reports readings that moved by more than REPORT_DELTA since
+ * the last one it sent, and at least every REPORT_HEARTBEAT.
+ */
+#ifndef REPORT_DELTA
+#define REPORT_DELTA 5
+#endif
+#ifndef REPORT_HEARTBEAT
+#define REPORT_HEARTBEAT (30 * CLOCK_SECOND)
+#endif
+
 /*---------------------------------------------------------------------------*/
 
 static const linkaddr_t null_parent = {{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }};
 
 static int in_net = 0;
 static linkaddr_t parent = {{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }};
-static int parent_strength = INT_MIN;
 static int parent_rank = INT_MAX;
+static int in_outage = 0;
+static clock_time_t outage_start;
 static m_rank_t rank = SENSOR;
-static linkaddr_t *children;
-static int nb_children;
-static linkaddr_t *dead_children;
-static int nb_dead_children;
+ADDR_TABLE(children, CHILDREN_TABLE_SIZE, CHILD_ALIVE_TIMEOUT);
 static m_sensor_t sensor_cat = NO_CAT;
+static int report_on_delta = 0;
+static int last_reported = INT_MIN;
+static clock_time_t last_report_time;
 
 static struct ctimer parent_alive_timeout_timer;
-static struct ctimer init_children_alive_timer;
 static struct ctimer children_alive_timer;
-static struct ctimer send_hello_timer;
+static struct ctimer topology_timer;
+static struct ctimer stats_timer;
 
 static struct ctimer app_message_timer;
 static struct ctimer light_off_timer;
@@ -44,11 +58,16 @@ AUTOSTART_PROCESSES(&sensor_process);
 
 static void set_irrigation_off(void *ptr) {
   leds_off(LEDS_GREEN);
-  m_packet_t msg = encode_app_message(SENSOR, APP_IRG_ACK, 0);
-  linkaddr_copy(&msg.src, &linkaddr_node_addr);
-  nullnet_buf = (uint8_t *)(&msg);
-  nullnet_len = sizeof(m_packet_t);
-  NETSTACK_NETWORK.output(&parent);
+  m_packet_t msg = new_app_message(SENSOR, APP_IRG_ACK, 0);
+  set_packet_origin(&msg);
+  set_packet_trace(&msg);
+  send_packet(&msg, &parent);
+}
+
+static void send_command_ack(const m_packet_t *command) {
+  m_packet_t msg = new_app_message(SENSOR, APP_CMD_ACK, command->seq);
+  set_packet_origin(&msg);
+  send_packet(&msg, &parent);
 }
 
 static void set_light_off(void *ptr) {
@@ -58,19 +77,26 @@ static void set_light_off(void *ptr) {
 void send_light_level() {
   int light_level = rand() % 100;
   light_level = light_level < 0 ? -light_level : light_level;
+  if (report_on_delta && last_reported != INT_MIN && abs(light_level - last_reported) <= REPORT_DELTA
+      && clock_time() - last_report_time < REPORT_HEARTBEAT) {
+    // not "Light level:", the benchmarks count those as sent
+    LOG_INFO("Light level kept: %d\n", light_level);
+    return;
+  }
   LOG_INFO("Light level: %d\n", light_level);
-  m_packet_t msg = encode_app_message(SENSOR, APP_LGT_LVL, light_level);
-  nullnet_buf = (uint8_t *)(&msg);
-  nullnet_len = sizeof(m_packet_t);
-  NETSTACK_NETWORK.output(&parent);
+  last_reported = light_level;
+  last_report_time = clock_time();
+  m_packet_t msg = new_app_message(SENSOR, APP_LGT_LVL, light_level);
+  set_packet_origin(&msg);
+  set_packet_trace(&msg);
+  send_packet(&msg, &parent);
 }
 
 void interact_with_light_sensor() {
   for (int i = 0; i < 5; i++) {
-    m_packet_t msg = encode_app_message(SENSOR, APP_MOB_LGT_SEN, 0);
-    nullnet_buf = (uint8_t *)(&msg);
-    nullnet_len = sizeof(m_packet_t);
-    NETSTACK_NETWORK.output(&parent);
+    m_packet_t msg = new_app_message(SENSOR, APP_MOB_LGT_SEN, 0);
+    set_packet_origin(&msg);
+    send_packet(&msg, &parent);
     LOG_INFO("Mobile terminal sent a message to the light sensor...\n");
   }
 }
@@ -83,178 +109,261 @@ static void send_app_message(void *ptr) {
     } else if (sensor_cat == MOB_TER) {
       interact_with_light_sensor();
     }
+#if SLEEPY_LEAF
+    // ask for what the parent kept while we were asleep
+    m_packet_t msg = new_message(SENSOR, POLL);
+    send_packet(&msg, &parent);
+#endif
   }
 }
 
-static void send_hello_message(void *ptr) {
-  m_packet_t msg = encode_message(SENSOR, HELLO);
-  nullnet_buf = (uint8_t *)(&msg);
-  nullnet_len = sizeof(m_packet_t);
-  NETSTACK_NETWORK.output(NULL);
+static void advertise_categories(void) {
+  if (in_net && categories_changed()) {
+    m_packet_t msg = new_hello_ack();
+    send_packet(&msg, &parent);
+  }
 }
 
 static void check_children_alive(void* ptr) {
-  for (int i = 0; i < nb_dead_children; i++) {
-    for (int j = 0; j < nb_children; j++) {
-      if (linkaddr_cmp(&dead_children[i], &children[j]) != 0) {
-        nb_children = remove_linkaddr(&children, nb_children, &children[j]);
-        j--;
-      }
-    }
-  }
-  free(dead_children);
-  LOG_INFO("Node has %d children:\n", nb_children);
-  for (int i = 0; i < nb_children; i++) {
-    LOG_INFO("> %02u%02u.%02u%02u.%02u%02u.%02u%02u\n", children[i].u8[0], children[i].u8[1], children[i].u8[2], children[i].u8[3], children[i].u8[4], children[i].u8[5], children[i].u8[6], children[i].u8[7]);
+  ctimer_reset(&children_alive_timer);
+  if (addr_table_expire(&children, route_purge) > 0) {
+    log_children(&children);
+    hello_inconsistent();
+    advertise_categories();
   }
-  ctimer_reset(&init_children_alive_timer);
+  route_expire();
+  neighbor_expire();
 }
 
-static void init_check_children_alive(void* ptr) {
-  nb_dead_children = nb_children;
-  dead_children = (linkaddr_t*) malloc(nb_dead_children * sizeof(linkaddr_t));
-  for (int i = 0; i < nb_dead_children; i++) {
-    dead_children[i] = children[i];
+static void send_topology_report(void *ptr) {
+  ctimer_reset(&topology_timer);
+  if (in_net) {
+    m_packet_t msg = new_topology_report();
+    send_packet(&msg, &parent);
+    // in case a category update got lost
+    m_packet_t ack = new_hello_ack();
+    send_packet(&ack, &parent);
+    int cursor = 0;
+    while (energy_report(&msg, &cursor))
+      send_packet(&msg, &parent);
   }
-  memcpy(dead_children, children, nb_children);
-  ctimer_set(&children_alive_timer, ALIVE_TIMEOUT_INTERVAL, check_children_alive, NULL);
 }
 
-static void parent_alive_timeout(void* ptr) {
-  in_net = 0;
-  parent = null_parent;
-  update_mote_color(in_net, rank, sensor_cat);
-  LOG_INFO("Timeout: No response received, detaching from parent\n");
+static void send_stats_report(void *ptr) {
+  if (in_net) {
+    m_packet_t msg;
+    int cursor = 0;
+    while (stats_report(&msg, &cursor))
+      send_packet(&msg, &parent);
+  }
 }
 
-void set_parent(const linkaddr_t* src, m_rank_t msgrank, int strength) {
+static void parent_alive_timeout(void* ptr);
+
+void set_parent(const linkaddr_t* src, m_rank_t msgrank) {
   in_net = 1;
   parent_rank = msgrank;
-  parent_strength = strength;
   linkaddr_copy(&parent, src);
   LOG_INFO("Set %02u%02u.%02u%02u.%02u%02u.%02u%02u as parent\n", parent.u8[0], parent.u8[1], parent.u8[2], parent.u8[3], parent.u8[4], parent.u8[5], parent.u8[6], parent.u8[7]);
   update_mote_color(in_net, rank, sensor_cat);
   ctimer_set(&parent_alive_timeout_timer, ALIVE_TIMEOUT_INTERVAL, parent_alive_timeout, NULL);
 }
 
+static void join_parent(const linkaddr_t *src, m_rank_t msgrank, int depth) {
+  linkaddr_t old_parent = parent;
+  set_parent(src, msgrank);
+  leaf_sleep_enable(SLEEPY_LEAF);
+  set_node_depth(depth + 1);
+  hello_inconsistent();
+  LOG_INFO("Node in network\n");
+  m_packet_t msg = new_hello_ack();
+  send_packet(&msg, &parent);
+  if (linkaddr_cmp(&old_parent, &null_parent) == 0 && linkaddr_cmp(&old_parent, &parent) == 0) {
+    m_packet_t msg = new_message(SENSOR, CHILD_DISCONNECT);
+    send_packet(&msg, &old_parent);
+    LOG_INFO("Parent changes: %u\n", count_parent_change());
+  }
+  if (in_outage) {
+    in_outage = 0;
+    LOG_INFO("Outage: %lu ms\n", (unsigned long)((clock_time() - outage_start) * 1000 / CLOCK_SECOND));
+  }
+}
+
+static void parent_lost(clock_time_t last_heard) {
+  in_outage = 1;
+  outage_start = last_heard;
+  ctimer_stop(&parent_alive_timeout_timer);
+  neighbor_forget(&parent);
+  parent = null_parent;
+  linkaddr_t backup;
+  int backup_rank = backup_parent(&children, &backup);
+  if (backup_rank != -1) {
+    LOG_INFO("Parent lost, failing over to a backup parent\n");
+    join_parent(&backup, backup_rank, neighbor_depth(&backup));
+    return;
+  }
+  in_net = 0;
+  hello_stop();
+  // any parent will do, however deep we used to be
+  set_node_depth(DEPTH_UNKNOWN);
+  // listen for HELLOs until a new parent is found
+  leaf_sleep_enable(0);
+  update_mote_color(in_net, rank, sensor_cat);
+  LOG_INFO("Parent lost, detaching from it\n");
+}
+
+static void parent_alive_timeout(void* ptr) {
+  // the parent was last heard one timeout ago
+  parent_lost(clock_time() - ALIVE_TIMEOUT_INTERVAL);
+}
+
 void input_callback(const void *data, uint16_t len, const linkaddr_t *src, const linkaddr_t *dest) {
   int strength = packetbuf_attr(PACKETBUF_ATTR_RSSI);
-  m_packet_t dmsg = *(m_packet_t*) data;
+  m_packet_t dmsg;
+  if (!receive_packet(data, len, &dmsg)) {
+    LOG_WARN("Dropping malformed packet (%u bytes)\n", len);
+    return;
+  }
+
+  // any frame from a child or the parent proves it is still alive
+  int child_slot = addr_table_touch(&children, src);
+  neighbor_touch(src);
+  if (in_net && linkaddr_cmp(src, &parent) != 0) {
+    ctimer_restart(&parent_alive_timeout_timer);
+    leaf_wake();
+  }
+  // upward traffic tells which child leads to its origin
+  if (dmsg.msgcat == APPLICATION && dmsg.flags & PKT_FLAG_SRC && linkaddr_cmp(dest, &linkaddr_null) == 0)
+    route_learn(&dmsg.src, child_slot);
+  flood_overhear(&dmsg, child_slot);
 
   if (dmsg.msgcat == HELLO) {
-    if (
-        (!in_net || (in_net && (dmsg.rank < parent_rank || (dmsg.rank == parent_rank && strength > parent_strength))))
-      && dmsg.rank != GATEWAY
-      && find_linkaddr(&children, nb_children, src) == -1 // potential parent not in the children
-    ) {
-      linkaddr_t old_parent = parent;
-      set_parent(src, dmsg.rank, strength);
-      ctimer_set(&send_hello_timer, CLOCK_SECOND, send_hello_message, NULL);
-      LOG_INFO("Node in network\n");
-      m_packet_t msg = encode_message(SENSOR, HELLO_ACK);
-      nullnet_buf = (uint8_t *)(&msg);
-      nullnet_len = sizeof(m_packet_t);
-      NETSTACK_NETWORK.output(&parent);
-      if (linkaddr_cmp(&old_parent, &null_parent) == 0 && linkaddr_cmp(&old_parent, &parent) == 0) {
-        m_packet_t msg = encode_message(SENSOR, CHILD_DISCONNECT);
-        nullnet_buf = (uint8_t *)(&msg);
-        nullnet_len = sizeof(m_packet_t);
-        NETSTACK_NETWORK.output(&old_parent);
-      }
+    // a parent this deep is most likely part of a loop through our subtree
+    if (in_net && linkaddr_cmp(src, &parent) != 0 && dmsg.depth != DEPTH_UNKNOWN && dmsg.depth + 1 > MAX_DEPTH) {
+      LOG_INFO("Parent at depth %u, leaving it\n", dmsg.depth);
+      parent_lost(clock_time());
+      return;
+    }
+    // potential parent not in the children
+    int candidate = dmsg.rank != GATEWAY && addr_table_find(&children, src) == -1;
+    if (candidate)
+      neighbor_heard(src, &dmsg, strength);
+    if (candidate && (!in_net ? parent_eligible(src) : parent_better(src, &parent))) {
+      join_parent(src, dmsg.rank, dmsg.depth);
     } else {
-      if (linkaddr_cmp(src, &parent) != 0) {
-        // can only receive HELLO from the parent to stay in the net
-        ctimer_set(&send_hello_timer, CLOCK_SECOND, send_hello_message, NULL);
-        ctimer_restart(&parent_alive_timeout_timer);
-      } else {
-        // remove child from dead children if it's alive
-        nb_dead_children = remove_linkaddr(&dead_children, nb_dead_children, src);
-      }
+      if (linkaddr_cmp(src, &parent) != 0 && set_node_depth(dmsg.depth + 1))
+        hello_inconsistent();
+      hello_heard(dmsg.rank);
     }
   }
 
   else if (dmsg.msgcat == HELLO_ACK) {
-    if (find_linkaddr(&children, nb_children, src) == -1) { // potential child not parent
-      nb_children = add_linkaddr(&children, nb_children, src);
-      LOG_INFO("Node has %d children:\n", nb_children);
-      for (int i = 0; i < nb_children; i++) {
-        LOG_INFO("> %02u%02u.%02u%02u.%02u%02u.%02u%02u\n", children[i].u8[0], children[i].u8[1], children[i].u8[2], children[i].u8[3], children[i].u8[4], children[i].u8[5], children[i].u8[6], children[i].u8[7]);
-      }
+    int slot = addr_table_find(&children, src);
+    if (slot == -1) { // potential child not parent
+      slot = addr_table_add(&children, src);
+      log_children(&children);
+      hello_inconsistent();
       linkaddr_t src_copy;
       linkaddr_copy(&src_copy, src);
     }
+    child_advertised(slot, &dmsg);
+    advertise_categories();
   }
 
   else if (dmsg.msgcat == CHILD_DISCONNECT) {
-    nb_children = remove_linkaddr(&children, nb_children, src);
-    LOG_INFO("Node has %d children:\n", nb_children);
-    for (int i = 0; i < nb_children; i++) {
-      LOG_INFO("> %02u%02u.%02u%02u.%02u%02u.%02u%02u\n", children[i].u8[0], children[i].u8[1], children[i].u8[2], children[i].u8[3], children[i].u8[4], children[i].u8[5], children[i].u8[6], children[i].u8[7]);
+    int slot = addr_table_remove(&children, src);
+    if (slot != -1) {
+      route_purge(slot);
+      hello_inconsistent();
+      advertise_categories();
     }
+    log_children(&children);
   }
 
-  else if (dmsg.msgcat == NULL_MSG);
+  else if (dmsg.msgcat == POLL) {
+    int sent = child_poll(src);
+    if (sent > 0)
+      LOG_INFO("Sent %d queued command(s) to a sleeping child\n", sent);
+  }
+
+  // end of what the parent had queued for us
+  else if (dmsg.msgcat == NULL_MSG) {
+    if (in_net && linkaddr_cmp(src, &parent) != 0)
+      leaf_sleep();
+  }
+
+  else if (dmsg.msgcat == FLOOD_ACK); // handled by flood_overhear()
 
   // APPLICATION packet
   else if (dmsg.msgcat == APPLICATION) {
-    // Forward the light level packet to the parent
+    // Forward the light level packet to the parent, once
     if (dmsg.appcat == APP_LGT_LVL) {
-      nullnet_buf = (uint8_t *)(&dmsg);
-      nullnet_len = sizeof(m_packet_t);
-      NETSTACK_NETWORK.output(&parent);
+      if (!packet_seen(&dmsg)) {
+        trace_forward(&dmsg);
+        send_packet(&dmsg, &parent);
+      }
     } else if (dmsg.appcat == APP_LGT_ON) {
+      // Commands are only taken from the parent, once
+      if (!flood_accept(&dmsg, src, &parent))
+        return;
       // Light up the lights if you're a light bulb
       if (sensor_cat == LGT_BLB) {
         leds_on(LEDS_GREEN);
         ctimer_set(&light_off_timer, dmsg.value * CLOCK_SECOND, set_light_off, NULL);
       }
-      // Forward the packet to the children
-      for (int i = 0; i < nb_children; i++) {
-        nullnet_buf = (uint8_t *)(&dmsg);
-        nullnet_len = sizeof(m_packet_t);
-        NETSTACK_NETWORK.output(&children[i]);
-      }
+      // The gateway waits for the target to confirm
+      if (dmsg.flags & PKT_FLAG_DST && linkaddr_cmp(&dmsg.dst, &linkaddr_node_addr) != 0)
+        send_command_ack(&dmsg);
+      // Forward the packet along its route, or to the children
+      int sent = send_packet_down(&dmsg, &children, &parent);
+      LOG_INFO("Command %d sent down in %d frame(s)\n", dmsg.appcat, sent);
     } else if (dmsg.appcat == APP_IRG_ON) {
+      // Commands are only taken from the parent, once
+      if (!flood_accept(&dmsg, src, &parent))
+        return;
       // Start irrigation if you're the irrigation system
       if (sensor_cat == IRG_SYS) {
         leds_on(LEDS_GREEN);
-        m_packet_t msg = encode_app_message(SENSOR, APP_IRG_ACK, 1);
-        linkaddr_copy(&msg.src, &linkaddr_node_addr);
-        nullnet_buf = (uint8_t *)(&msg);
-        nullnet_len = sizeof(m_packet_t);
-        NETSTACK_NETWORK.output(&parent);
+        m_packet_t msg = new_app_message(SENSOR, APP_IRG_ACK, 1);
+        set_packet_origin(&msg);
+        set_packet_trace(&msg);
+        send_packet(&msg, &parent);
+        send_command_ack(&dmsg);
         ctimer_set(&irrigation_off_timer, dmsg.value * CLOCK_SECOND, set_irrigation_off, NULL);
       }
-      // Forward the packet to the children
-      for (int i = 0; i < nb_children; i++) {
-        nullnet_buf = (uint8_t *)(&dmsg);
-        nullnet_len = sizeof(m_packet_t);
-        NETSTACK_NETWORK.output(&children[i]);
-      }
+      // Forward the packet to the children with an irrigation system below
+      int sent = flood_packet(&dmsg, &children, &parent);
+      LOG_INFO("Command %d sent down in %d frame(s)\n", dmsg.appcat, sent);
       // Irrigation acknowledgement
-    } else if (dmsg.appcat == APP_IRG_ACK) {
-      nullnet_buf = (uint8_t *)(&dmsg);
-      nullnet_len = sizeof(m_packet_t);
-      NETSTACK_NETWORK.output(&parent);
+    } else if (dmsg.appcat == APP_IRG_ACK || dmsg.appcat == APP_TOPO || dmsg.appcat == APP_CMD_ACK
+        || dmsg.appcat == APP_ENERGY) {
+      if (!packet_seen(&dmsg)) {
+        trace_forward(&dmsg);
+        send_packet(&dmsg, &parent);
+      }
+    } else if (dmsg.appcat == APP_STATS) {
+      if (dmsg.flags & PKT_FLAG_PAYLOAD) {
+        // an answer on its way to the gateway
+        if (!packet_seen(&dmsg))
+          send_packet(&dmsg, &parent);
+      } else if (flood_accept(&dmsg, src, &parent)) {
+        flood_packet(&dmsg, &children, &parent);
+        // spread the answers of the whole tree
+        ctimer_set(&stats_timer, random_rand() % STATS_REPLY_JITTER, send_stats_report, NULL);
+      }
     } else if (dmsg.appcat == APP_MOB_LGT_SEN) {
       if (dmsg.value % 2 == 0) {
-        nullnet_buf = (uint8_t *)(&dmsg);
-        nullnet_len = sizeof(m_packet_t);
-        NETSTACK_NETWORK.output(&parent);
-      } else {
+        if (!packet_seen(&dmsg))
+          send_packet(&dmsg, &parent);
+      } else if (flood_accept(&dmsg, src, &parent)) {
         if (dmsg.value == 1 && sensor_cat == LGT_SEN) {
-          dmsg.value++;
-          nullnet_buf = (uint8_t *)(&dmsg);
-          nullnet_len = sizeof(m_packet_t);
-          NETSTACK_NETWORK.output(&parent);
+          m_packet_t msg = new_app_message(SENSOR, APP_MOB_LGT_SEN, dmsg.value + 1);
+          set_packet_origin(&msg);
+          send_packet(&msg, &parent);
         } else if (dmsg.value == 3 && sensor_cat == MOB_TER) {
           LOG_INFO("Mobile terminal got a response from the light sensor...\n");
         } else {
-          for (int i = 0; i < nb_children; i++) {
-            nullnet_buf = (uint8_t *)(&dmsg);
-            nullnet_len = sizeof(m_packet_t);
-            NETSTACK_NETWORK.output(&children[i]);
-          }
+          flood_packet(&dmsg, &children, &parent);
         }
       }
     }
@@ -262,6 +371,7 @@ void input_callback(const void *data, uint16_t len, const linkaddr_t *src, const
 
   else {
     LOG_INFO("/!\\ Message answer not yet implemented: %d\n", dmsg.msgcat);
+    count_stat(dmsg.msgcat, STAT_UNHANDLED);
   }
 
 }
@@ -283,7 +393,17 @@ static int uart_rx_callback(unsigned char c) {
     sensor_cat = LGT_BLB;
     LOG_INFO("Set sensor to %d", LGT_BLB);
   }
+  else if (c == 'e') {
+    report_on_delta = 1;
+    LOG_INFO("Reporting light on delta > %d", REPORT_DELTA);
+  }
+  else if (c == 'p') {
+    report_on_delta = 0;
+    LOG_INFO("Reporting light periodically");
+  }
   update_mote_color(in_net, rank, sensor_cat);
+  // runs from the UART interrupt: the process advertises the category
+  process_poll(&sensor_process);
   return 0;
 }
 
@@ -295,12 +415,14 @@ PROCESS_THREAD(sensor_process, ev, data) {
   tsch_set_coordinator(linkaddr_cmp(&coordinator_addr, &linkaddr_node_addr));
 #endif /* MAC_CONF_WITH_TSCH */
 
+  init_commons(rank, &children);
   nullnet_set_input_callback(input_callback);
 
   uart0_init(BAUD2UBR(115200)); //set the baud rate as necessary
   uart0_set_input(uart_rx_callback); //set the callback function
 
-  ctimer_set(&init_children_alive_timer, CLOCK_SECOND, init_check_children_alive, NULL);
+  ctimer_set(&children_alive_timer, CHILDREN_SWEEP_INTERVAL, check_children_alive, NULL);
+  ctimer_set(&topology_timer, TOPO_REPORT_INTERVAL, send_topology_report, NULL);
   ctimer_set(&app_message_timer, 5 * CLOCK_SECOND, send_app_message, NULL);
 
   // Initialize random
@@ -314,6 +436,11 @@ PROCESS_THREAD(sensor_process, ev, data) {
 
   while(1) {
     PROCESS_WAIT_EVENT();
+    // the category may have changed from the UART
+    if (ev == PROCESS_EVENT_POLL) {
+      set_node_category(sensor_cat);
+      advertise_categories();
+    }
   }
 
   PROCESS_END();
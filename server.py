@@ -15,18 +15,60 @@ HELLO = 1
 HELLO_ACK = 2
 CHILD_DISCONNECT = 3
 APPLICATION = 4
+FLOOD_ACK = 5
+POLL = 6
 
 NULL_APP = 0
 APP_LGT_LVL = 1
 APP_LGT_ON = 2
 APP_IRG_ON = 3
 APP_IRG_ACK = 4
+APP_MOB_LGT_SEN = 5
+APP_LGT_BATCH = 6
+APP_LGT_AGG = 7
+APP_TOPO = 8
+APP_CMD_ACK = 9
+APP_ENERGY = 10
+APP_LATENCY = 11
+APP_STATS = 12
+
+# accounting classes: msgcat, or NB_MSGCAT + appcat for application messages
+MSGCAT_NAMES = ["NULL_MSG", "HELLO", "HELLO_ACK", "CHILD_DISCONNECT", "APPLICATION", "FLOOD_ACK", "POLL"]
+APPCAT_NAMES = ["NULL_APP", "LGT_LVL", "LGT_ON", "IRG_ON", "IRG_ACK", "MOB_LGT_SEN", "LGT_BATCH", "LGT_AGG", "TOPO", "CMD_ACK", "ENERGY", "LATENCY", "STATS"]
+# per-msgcat counters of an APP_STATS record, in order
+STAT_NAMES = ["rx", "tx", "fwd", "no parent", "malformed", "dup", "unhandled"]
+
+CMD_FAILED = 0
+CMD_DELIVERED = 1
+CMD_REJECTED = 2
+CMD_STATUS = {CMD_FAILED: "failed", CMD_DELIVERED: "delivered", CMD_REJECTED: "rejected"}
 
 NO_CAT = 0
 IRG_SYS = 1
 MOB_TER = 2
 LGT_SEN = 3
 LGT_BLB = 4
+CATEGORY_NAMES = ["none", "irrigation", "mobile", "light sensor", "light bulb"]
+
+# upper bounds (ms) of the gateway's latency buckets, the last one has no bound
+LATENCY_BOUNDS = [10, 20, 50, 100, 200, 500, 1000, 2000, 5000]
+
+SERIAL_FRAME_RECORDS = 0x01
+SERIAL_FRAME_COMMANDS = 0x02
+
+SLIP_END = 0xC0
+SLIP_ESC = 0xDB
+SLIP_ESC_END = 0xDC
+SLIP_ESC_ESC = 0xDD
+
+NULL_ADDR = "0000.0000.0000.0000"
+
+RATE_INTERVAL = 10
+QUERY_INTERVAL = 10
+CACHE_INTERVAL = 5
+LATENCY_INTERVAL = 60
+STATS_INTERVAL = 120
+QUERY_SNAPSHOT = -1
 
 def recv(sock):
     data = sock.recv(1)
@@ -36,43 +78,254 @@ def recv(sock):
         data = sock.recv(1)
     return buf
 
-def main(ip, port):
+def crc16(data):
+    # same as Contiki's lib/crc16.c
+    acc = 0
+    for b in data:
+        acc ^= b
+        acc = ((acc >> 8) | (acc << 8)) & 0xFFFF
+        acc ^= (acc & 0xFF00) << 4
+        acc &= 0xFFFF
+        acc ^= (acc >> 8) >> 4
+        acc ^= (acc & 0xFF00) >> 5
+    return acc
+
+def recv_frame(sock):
+    buf = bytearray()
+    escaped = False
+    while True:
+        c = sock.recv(1)[0]
+        if c == SLIP_END:
+            if buf:
+                return bytes(buf)
+            continue
+        if c == SLIP_ESC:
+            escaped = True
+            continue
+        if escaped:
+            c = SLIP_END if c == SLIP_ESC_END else SLIP_ESC
+            escaped = False
+        buf.append(c)
+
+def send_frame(sock, frame):
+    crc = crc16(frame)
+    frame += bytes([crc & 0xFF, crc >> 8])
+    out = bytearray([SLIP_END])
+    for c in frame:
+        if c == SLIP_END:
+            out += bytes([SLIP_ESC, SLIP_ESC_END])
+        elif c == SLIP_ESC:
+            out += bytes([SLIP_ESC, SLIP_ESC_ESC])
+        else:
+            out.append(c)
+    out.append(SLIP_END)
+    sock.send(bytes(out))
+
+def format_addr(addr):
+    h = addr.hex()
+    return ".".join(h[i:i + 4] for i in range(0, len(h), 4))
+
+def decode_frame(frame):
+    if len(frame) < 4 or frame[0] != SERIAL_FRAME_RECORDS:
+        return None
+    if crc16(frame[:-2]) != frame[-2] | (frame[-1] << 8):
+        return None
+    records = []
+    pos = 2
+    for _ in range(frame[1]):
+        length = frame[pos]
+        record = frame[pos:pos + length]
+        rpacket = {
+            "rank": record[1],
+            "msgcat": record[2],
+            "appcat": record[3],
+            "value": int.from_bytes(record[4:6], "little", signed=True),
+            "src": format_addr(record[6:14]),
+        }
+        extra = [int.from_bytes(record[i:i + 2], "little", signed=True) for i in range(14, length, 2)]
+        if rpacket["appcat"] == APP_LGT_AGG and len(extra) == 3:
+            rpacket["min"], rpacket["max"], rpacket["mean"] = extra
+        elif rpacket["appcat"] == APP_CMD_ACK and len(extra) == 2:
+            rpacket["cmd"], rpacket["attempts"] = extra
+        elif rpacket["appcat"] == APP_ENERGY and len(extra) == 3:
+            rpacket["duty"] = extra
+        elif rpacket["appcat"] == APP_ENERGY and len(extra) == 6:
+            rpacket["classes"] = [[rpacket["value"]] + extra]
+        elif rpacket["appcat"] in (APP_LGT_LVL, APP_IRG_ACK) and len(extra) == 3:
+            rpacket["age"], rpacket["t"], rpacket["cat"] = extra
+        elif rpacket["appcat"] in (APP_LGT_LVL, APP_IRG_ACK) and len(extra) == 4:
+            rpacket["lat"], rpacket["hops"], rpacket["t0"], rpacket["cat"] = extra
+            rpacket["t0"] &= 0xFFFF
+        elif rpacket["appcat"] == APP_STATS and len(extra) == 3 + len(MSGCAT_NAMES) * len(STAT_NAMES):
+            rpacket["parent_changes"], rpacket["queue_peak"], rpacket["queue_drops"] = (e & 0xFFFF for e in extra[:3])
+            n = len(STAT_NAMES)
+            rpacket["counters"] = [[e & 0xFFFF for e in extra[3 + i:3 + i + n]] for i in range(0, len(extra) - 3, n)]
+        elif rpacket["appcat"] == APP_LATENCY and len(extra) > len(LATENCY_BOUNDS) + 1:
+            rpacket["latency"] = [e & 0xFFFF for e in extra[:len(LATENCY_BOUNDS) + 1]]
+            rpacket["hops"] = [e & 0xFFFF for e in extra[len(LATENCY_BOUNDS) + 1:]]
+        records.append(rpacket)
+        pos += length
+    return records
+
+def send_commands(sock, commands, binary, clie_token):
+    if not commands:
+        return
+    if binary:
+        frame = bytearray([SERIAL_FRAME_COMMANDS, len(commands)])
+        for appcat, value, dst in commands:
+            frame += bytes([14, GATEWAY, APPLICATION, appcat])
+            frame += value.to_bytes(2, "little", signed=True)
+            frame += bytes.fromhex(dst.replace(".", ""))
+        send_frame(sock, frame)
+    else:
+        for appcat, value, dst in commands:
+            sock.send(f"{clie_token}{GATEWAY}|{APPLICATION}|{appcat}|{value}|{dst}\n".encode("utf-8"))
+
+def class_name(c):
+    if c < len(MSGCAT_NAMES):
+        return MSGCAT_NAMES[c]
+    return APPCAT_NAMES[c - len(MSGCAT_NAMES)] if c - len(MSGCAT_NAMES) < len(APPCAT_NAMES) else str(c)
+
+def print_energy(rpacket):
+    print(f"[ADDR {rpacket['src']}]", end="")
+    if "duty" in rpacket:
+        cpu, listen, tx = (d / 100 for d in rpacket["duty"])
+        print(f" cpu {cpu:.2f}%, listen {listen:.2f}%, transmit {tx:.2f}%", end="")
+    for c, txf, rxf, txb, rxb, txms, rxms in rpacket.get("classes", []):
+        print(f" {class_name(c)}: tx {txf}/{txb}B/{txms}ms rx {rxf}/{rxb}B/{rxms}ms", end="")
+
+def print_latency(rpacket):
+    cat = rpacket["value"]
+    print(f"[LATENCY] {CATEGORY_NAMES[cat] if 0 <= cat < len(CATEGORY_NAMES) else cat}:", end="")
+    for i, n in enumerate(rpacket["latency"]):
+        if n > 0:
+            bound = f"<={LATENCY_BOUNDS[i]}" if i < len(LATENCY_BOUNDS) else f">{LATENCY_BOUNDS[-1]}"
+            print(f" {bound}ms {n}", end="")
+    print(" | hops", end="")
+    for i, n in enumerate(rpacket["hops"]):
+        if n > 0:
+            print(f" {i}{'+' if i == len(rpacket['hops']) - 1 else ''}: {n}", end="")
+
+def print_stats(rpacket):
+    print(f"[NODE {rpacket['src']}] rank {rpacket['rank']}, {rpacket['value']} children, {rpacket['parent_changes']} parent change(s),"
+          f" TX queue peak {rpacket['queue_peak']}, {rpacket['queue_drops']} dropped", end="")
+    for msgcat, counters in enumerate(rpacket["counters"]):
+        if any(counters):
+            fields = ", ".join(f"{name} {n}" for name, n in zip(STAT_NAMES, counters) if n > 0)
+            print(f" {class_name(msgcat)}: {fields};", end="")
+
+def handle_packet(rpacket, commands):
+    if rpacket["appcat"] == APP_ENERGY:
+        print_energy(rpacket)
+    elif rpacket["appcat"] == APP_LATENCY:
+        print_latency(rpacket)
+    elif rpacket["appcat"] == APP_STATS:
+        print_stats(rpacket)
+    elif rpacket["rank"] == SENSOR and rpacket["msgcat"] == APPLICATION:
+        print(f"[ADDR {rpacket['src']}]", end="")
+        if rpacket["appcat"] == APP_LGT_LVL and "age" in rpacket:
+            # answer from the gateway's cache, the reading was already handled
+            print(f" light value: {rpacket['value']:02d} at t={rpacket['t']} ({rpacket['age']} sec ago)", end="")
+        elif rpacket["appcat"] == APP_LGT_LVL:
+            print(f" light value: {rpacket['value']:02d}", end="")
+            if "lat" in rpacket:
+                print(f" (~{rpacket['lat']} ms, {rpacket['hops']} hop(s))", end="")
+            if rpacket["value"] < 20:
+                commands.append((APP_LGT_ON, X, rpacket["src"]))
+                print(f" -> set lights on for {X:02d} sec...", end="")
+        elif rpacket["appcat"] == APP_IRG_ACK and "age" in rpacket:
+            print(f" irrigation {'on' if rpacket['value'] == 1 else 'off'} at t={rpacket['t']} ({rpacket['age']} sec ago)", end="")
+        elif rpacket["appcat"] == APP_IRG_ACK:
+            if rpacket["value"] == 1:
+                print(f" irrigation is on...", end="")
+            else:
+                print(f" irrigation is off.", end="")
+    elif rpacket["rank"] == GATEWAY and rpacket["appcat"] == APP_LGT_LVL:
+        print(f"[CACHE] {rpacket['value']} reading(s), gateway time {rpacket['t']}", end="")
+    elif rpacket["rank"] == GATEWAY and rpacket["appcat"] == APP_CMD_ACK:
+        print(f"[ADDR {rpacket['src']}] command {rpacket['cmd']} {CMD_STATUS.get(rpacket['value'], 'unknown')} after {rpacket['attempts']} attempt(s)", end="")
+    elif rpacket["appcat"] == APP_LGT_AGG:
+        print(f"[ADDR {rpacket['src']}] {rpacket['value']} light values: min {rpacket['min']:02d}, max {rpacket['max']:02d}, mean {rpacket['mean']:02d}", end="")
+    print()
+
+def main(ip, port, binary):
     sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     sock.connect((ip, port))
 
     tick = 0
+    nb_records = 0
+    nb_bad = 0
+    rate_start = time.time()
+    last_reading = {}
+    query_start = time.time()
+    # first a snapshot of the gateway's cache, then what changed since
+    cache_since = QUERY_SNAPSHOT
+    cache_start = time.time()
+    latency_start = time.time()
+    stats_start = time.time()
 
     while True:
-        data = recv(sock)
-        data = data.decode("utf-8")
         serv_token = "[2serv]"
         clie_token = "[2clie]"
-        if data.startswith(serv_token):
+        commands = []
+        if binary:
+            records = decode_frame(recv_frame(sock))
+            if records is None:
+                # bad CRC, or plain log output from the gateway
+                nb_bad += 1
+                records = []
+        else:
+            records = []
+            data = recv(sock)
+            data = data.decode("utf-8")
+            if data.startswith(serv_token):
+                try:
+                    records.append(json.loads(data[len(serv_token):]))
+                except:
+                    print("Error when decoding JSON:", data)
+
+        for rpacket in records:
             try:
-                data = data[len(serv_token):]
-                rpacket = json.loads(data)
-                if rpacket["rank"] == SENSOR and rpacket["msgcat"] == APPLICATION:
-                    print(f"[ADDR {rpacket['src']}]", end="")
-                    if rpacket["appcat"] == APP_LGT_LVL:
-                        print(f" light value: {rpacket['value']:02d}", end="")
-                        if rpacket["value"] < 20:
-                            spacket = f"{clie_token}{GATEWAY}|{APPLICATION}|{APP_LGT_ON}|{X}|{rpacket['src']}\n".encode("utf-8")
-                            sock.send(spacket)
-                            print(f" -> set lights on for {X:02d} sec...", end="")
-                    elif rpacket["appcat"] == APP_IRG_ACK:
-                        if rpacket["value"] == 1:
-                            print(f" irrigation is on...", end="")
-                        else:
-                            print(f" irrigation is off.", end="")
-                print()
-            except:
-                print("Error when decoding JSON:", data)
-        
+                handle_packet(rpacket, commands)
+                if rpacket["appcat"] == APP_LGT_LVL and "age" not in rpacket:
+                    last_reading[rpacket["src"]] = time.time()
+                if rpacket["rank"] == GATEWAY and rpacket["appcat"] == APP_LGT_LVL:
+                    cache_since = rpacket["t"]
+            except KeyError:
+                print("Incomplete record:", rpacket)
+        nb_records += len(records)
+
         if tick % 20 == 0:
-            spacket = f"{clie_token}{GATEWAY}|{APPLICATION}|{APP_IRG_ON}|{Y}|{rpacket['src']}\n".encode("utf-8")
-            sock.send(spacket)
+            commands.append((APP_IRG_ON, Y, NULL_ADDR))
             print(f"[ADDR xxxx.xxxx.xxxx.xxxx] -> set irrigation on for {Y:02d} sec...")
-        
+
+        # sensors reporting on delta stay quiet while their light is stable
+        if time.time() - query_start >= QUERY_INTERVAL:
+            for addr, last in last_reading.items():
+                if time.time() - last >= QUERY_INTERVAL:
+                    commands.append((APP_LGT_LVL, 0, addr))
+            query_start = time.time()
+
+        if time.time() - cache_start >= CACHE_INTERVAL:
+            commands.append((APP_LGT_LVL, cache_since, NULL_ADDR))
+            cache_start = time.time()
+
+        if time.time() - latency_start >= LATENCY_INTERVAL:
+            commands.append((APP_LATENCY, 0, NULL_ADDR))
+            latency_start = time.time()
+
+        if time.time() - stats_start >= STATS_INTERVAL:
+            commands.append((APP_STATS, 0, NULL_ADDR))
+            stats_start = time.time()
+
+        send_commands(sock, commands, binary, clie_token)
+
+        elapsed = time.time() - rate_start
+        if elapsed >= RATE_INTERVAL:
+            print(f"[STATS] {nb_records / elapsed:.1f} records/s ({'binary' if binary else 'json'}), {nb_bad} frames dropped")
+            nb_records = 0
+            rate_start = time.time()
+
         tick += 1
 
 if __name__ == "__main__":
@@ -80,6 +333,7 @@ if __name__ == "__main__":
     parser = argparse.ArgumentParser()
     parser.add_argument("--ip", dest="ip", type=str)
     parser.add_argument("--port", dest="port", type=int)
+    parser.add_argument("--binary", dest="binary", action="store_true", help="gateway built with SERIAL_BINARY=1")
     args = parser.parse_args()
 
-    main(args.ip, args.port)
+    main(args.ip, args.port, args.binary)
@@ -7,6 +7,7 @@
 #include <limits.h>
 #include "sys/node-id.h"
 #include "net/packetbuf.h"
+#include "lib/random.h"
 #include "commons.h"
 
 /*---------------------------------------------------------------------------*/
@@ -15,155 +16,250 @@ static const linkaddr_t null_parent = {{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0
 
 static int in_net = 0;
 static linkaddr_t parent = {{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }};
-static int parent_strength = INT_MIN;
 static int parent_rank = INT_MAX;
+static int in_outage = 0;
+static clock_time_t outage_start;
 static m_rank_t rank = SUBGATEWAY;
-static linkaddr_t *children;
-static int nb_children;
-static linkaddr_t *dead_children;
-static int nb_dead_children;
+ADDR_TABLE(children, CHILDREN_TABLE_SIZE, CHILD_ALIVE_TIMEOUT);
 
 static struct ctimer parent_alive_timeout_timer;
-static struct ctimer init_children_alive_timer;
 static struct ctimer children_alive_timer;
-static struct ctimer send_hello_timer;
+static struct ctimer topology_timer;
+static struct ctimer stats_timer;
+static struct ctimer batch_timer;
+
+static m_batch_t batch;
 
 /*---------------------------------------------------------------------------*/
 PROCESS(subgateway_process, "Subgateway process");
 AUTOSTART_PROCESSES(&subgateway_process);
 /*---------------------------------------------------------------------------*/
 
-static void send_hello_message(void *ptr) {
-  m_packet_t msg = encode_message(SUBGATEWAY, HELLO);
-  nullnet_buf = (uint8_t *)(&msg);
-  nullnet_len = sizeof(m_packet_t);
-  NETSTACK_NETWORK.output(NULL);
+static void advertise_categories(void) {
+  if (in_net && categories_changed()) {
+    m_packet_t msg = new_hello_ack();
+    send_packet(&msg, &parent);
+  }
 }
 
 static void check_children_alive(void* ptr) {
-  for (int i = 0; i < nb_dead_children; i++) {
-    for (int j = 0; j < nb_children; j++) {
-      if (linkaddr_cmp(&dead_children[i], &children[j]) != 0) {
-        nb_children = remove_linkaddr(&children, nb_children, &children[j]);
-        j--;
-      }
-    }
+  ctimer_reset(&children_alive_timer);
+  if (addr_table_expire(&children, route_purge) > 0) {
+    log_children(&children);
+    hello_inconsistent();
+    advertise_categories();
   }
-  free(dead_children);
-  LOG_INFO("Node has %d children:\n", nb_children);
-  for (int i = 0; i < nb_children; i++) {
-    LOG_INFO("> %02u%02u.%02u%02u.%02u%02u.%02u%02u\n", children[i].u8[0], children[i].u8[1], children[i].u8[2], children[i].u8[3], children[i].u8[4], children[i].u8[5], children[i].u8[6], children[i].u8[7]);
-  }
-  ctimer_reset(&init_children_alive_timer);
+  route_expire();
+  neighbor_expire();
+}
+
+static void flush_batch(void *ptr) {
+  if (batch.count == 0)
+    return;
+  m_packet_t msg = batch_packet(&batch, SUBGATEWAY);
+  set_packet_origin(&msg);
+  // the oldest reading's trace, it waited the longest
+  trace_forward(&msg);
+  send_packet(&msg, &parent);
+  batch_reset(&batch);
 }
 
-static void init_check_children_alive(void* ptr) {
-  nb_dead_children = nb_children;
-  dead_children = (linkaddr_t*) malloc(nb_dead_children * sizeof(linkaddr_t));
-  for (int i = 0; i < nb_dead_children; i++) {
-    dead_children[i] = children[i];
+static void send_topology_report(void *ptr) {
+  ctimer_reset(&topology_timer);
+  if (in_net) {
+    m_packet_t msg = new_topology_report();
+    send_packet(&msg, &parent);
+    // in case a category update got lost
+    m_packet_t ack = new_hello_ack();
+    send_packet(&ack, &parent);
+    int cursor = 0;
+    while (energy_report(&msg, &cursor))
+      send_packet(&msg, &parent);
   }
-  memcpy(dead_children, children, nb_children);
-  ctimer_set(&children_alive_timer, ALIVE_TIMEOUT_INTERVAL, check_children_alive, NULL);
 }
 
-static void parent_alive_timeout(void* ptr) {
-  in_net = 0;
-  parent = null_parent;
-  update_mote_color(in_net, rank, NO_CAT);
-  LOG_INFO("Timeout: No response received, detaching from parent\n");
+static void send_stats_report(void *ptr) {
+  if (in_net) {
+    m_packet_t msg;
+    int cursor = 0;
+    while (stats_report(&msg, &cursor))
+      send_packet(&msg, &parent);
+  }
 }
 
-void set_parent(const linkaddr_t* src, m_rank_t msgrank, int strength) {
+static void parent_alive_timeout(void* ptr);
+
+void set_parent(const linkaddr_t* src, m_rank_t msgrank) {
   in_net = 1;
   parent_rank = msgrank;
-  parent_strength = strength;
   linkaddr_copy(&parent, src);
   LOG_INFO("Set %02u%02u.%02u%02u.%02u%02u.%02u%02u as parent (%d)\n", parent.u8[0], parent.u8[1], parent.u8[2], parent.u8[3], parent.u8[4], parent.u8[5], parent.u8[6], parent.u8[7], msgrank);
   update_mote_color(in_net, rank, NO_CAT);
   ctimer_set(&parent_alive_timeout_timer, ALIVE_TIMEOUT_INTERVAL, parent_alive_timeout, NULL);
 }
 
+static void join_parent(const linkaddr_t *src, m_rank_t msgrank, int depth) {
+  linkaddr_t old_parent = parent;
+  set_parent(src, msgrank);
+  set_node_depth(depth + 1);
+  hello_inconsistent();
+  LOG_INFO("Node in network\n");
+  m_packet_t msg = new_hello_ack();
+  send_packet(&msg, &parent);
+  if (linkaddr_cmp(&old_parent, &null_parent) == 0 && linkaddr_cmp(&old_parent, &parent) == 0) {
+    m_packet_t msg = new_message(SUBGATEWAY, CHILD_DISCONNECT);
+    send_packet(&msg, &old_parent);
+    LOG_INFO("Parent changes: %u\n", count_parent_change());
+  }
+  if (in_outage) {
+    in_outage = 0;
+    LOG_INFO("Outage: %lu ms\n", (unsigned long)((clock_time() - outage_start) * 1000 / CLOCK_SECOND));
+  }
+}
+
+static void parent_alive_timeout(void* ptr) {
+  // the parent was last heard one timeout ago
+  in_outage = 1;
+  outage_start = clock_time() - ALIVE_TIMEOUT_INTERVAL;
+  neighbor_forget(&parent);
+  parent = null_parent;
+  linkaddr_t backup;
+  int backup_rank = backup_parent(&children, &backup);
+  if (backup_rank != -1) {
+    LOG_INFO("Timeout: parent lost, failing over to a backup parent\n");
+    join_parent(&backup, backup_rank, neighbor_depth(&backup));
+    return;
+  }
+  in_net = 0;
+  hello_stop();
+  // any parent will do, however deep we used to be
+  set_node_depth(DEPTH_UNKNOWN);
+  update_mote_color(in_net, rank, NO_CAT);
+  LOG_INFO("Timeout: No response received, detaching from parent\n");
+}
+
 void input_callback(const void *data, uint16_t len, const linkaddr_t *src, const linkaddr_t *dest) {
   int strength = packetbuf_attr(PACKETBUF_ATTR_RSSI);
-  m_packet_t dmsg = *(m_packet_t*) data;
+  m_packet_t dmsg;
+  if (!receive_packet(data, len, &dmsg)) {
+    LOG_WARN("Dropping malformed packet (%u bytes)\n", len);
+    return;
+  }
+
+  // any frame from a child or the parent proves it is still alive
+  int child_slot = addr_table_touch(&children, src);
+  neighbor_touch(src);
+  if (in_net && linkaddr_cmp(src, &parent) != 0)
+    ctimer_restart(&parent_alive_timeout_timer);
+  // upward traffic tells which child leads to its origin
+  if (dmsg.msgcat == APPLICATION && dmsg.flags & PKT_FLAG_SRC && linkaddr_cmp(dest, &linkaddr_null) == 0)
+    route_learn(&dmsg.src, child_slot);
+  flood_overhear(&dmsg, child_slot);
 
   if (dmsg.msgcat == HELLO) {
-    if (!in_net && dmsg.rank == GATEWAY) {
-      linkaddr_t old_parent = parent;
-      set_parent(src, dmsg.rank, strength);
-      ctimer_set(&send_hello_timer, CLOCK_SECOND, send_hello_message, NULL);
-      LOG_INFO("Node in network\n");
-      m_packet_t msg = encode_message(SUBGATEWAY, HELLO_ACK);
-      nullnet_buf = (uint8_t *)(&msg);
-      nullnet_len = sizeof(m_packet_t);
-      NETSTACK_NETWORK.output(&parent);
-      if (linkaddr_cmp(&old_parent, &null_parent) == 0 && linkaddr_cmp(&old_parent, &parent) == 0) {
-        m_packet_t msg = encode_message(SUBGATEWAY, CHILD_DISCONNECT);
-        nullnet_buf = (uint8_t *)(&msg);
-        nullnet_len = sizeof(m_packet_t);
-        NETSTACK_NETWORK.output(&old_parent);
-      }
+    if (dmsg.rank == GATEWAY)
+      neighbor_heard(src, &dmsg, strength);
+    if (dmsg.rank == GATEWAY && (!in_net || parent_better(src, &parent))) {
+      join_parent(src, dmsg.rank, dmsg.depth);
     } else {
-      if (linkaddr_cmp(src, &parent) != 0) {
-        // can only receive HELLO from the parent to stay in the net
-        ctimer_set(&send_hello_timer, CLOCK_SECOND, send_hello_message, NULL);
-        ctimer_restart(&parent_alive_timeout_timer);
-      } else {
-        // remove child from dead children if it's alive
-        nb_dead_children = remove_linkaddr(&dead_children, nb_dead_children, src);
-      }
+      if (linkaddr_cmp(src, &parent) != 0 && set_node_depth(dmsg.depth + 1))
+        hello_inconsistent();
+      hello_heard(dmsg.rank);
     }
   }
 
   else if (dmsg.msgcat == HELLO_ACK) {
-    nb_children = add_linkaddr(&children, nb_children, src);
-    LOG_INFO("Node has %d children:\n", nb_children);
-    for (int i = 0; i < nb_children; i++) {
-      LOG_INFO("> %02u%02u.%02u%02u.%02u%02u.%02u%02u\n", children[i].u8[0], children[i].u8[1], children[i].u8[2], children[i].u8[3], children[i].u8[4], children[i].u8[5], children[i].u8[6], children[i].u8[7]);
+    int slot = addr_table_find(&children, src);
+    if (slot == -1) {
+      slot = addr_table_add(&children, src);
+      hello_inconsistent();
     }
+    child_advertised(slot, &dmsg);
+    advertise_categories();
+    log_children(&children);
     linkaddr_t src_copy;
     linkaddr_copy(&src_copy, src);
   }
 
   else if (dmsg.msgcat == CHILD_DISCONNECT) {
-    nb_children = remove_linkaddr(&children, nb_children, src);
-    LOG_INFO("Node has %d children:\n", nb_children);
-    for (int i = 0; i < nb_children; i++) {
-      LOG_INFO("> %02u%02u.%02u%02u.%02u%02u.%02u%02u\n", children[i].u8[0], children[i].u8[1], children[i].u8[2], children[i].u8[3], children[i].u8[4], children[i].u8[5], children[i].u8[6], children[i].u8[7]);
+    int slot = addr_table_remove(&children, src);
+    if (slot != -1) {
+      route_purge(slot);
+      hello_inconsistent();
+      advertise_categories();
     }
+    log_children(&children);
+  }
+
+  else if (dmsg.msgcat == POLL) {
+    int sent = child_poll(src);
+    if (sent > 0)
+      LOG_INFO("Sent %d queued command(s) to a sleeping child\n", sent);
   }
 
   else if (dmsg.msgcat == NULL_MSG);
 
+  else if (dmsg.msgcat == FLOOD_ACK); // handled by flood_overhear()
+
   else if (dmsg.msgcat == APPLICATION) {
 
     if (dmsg.appcat == APP_LGT_LVL) {
-      nullnet_buf = (uint8_t *)(&dmsg);
-      nullnet_len = sizeof(m_packet_t);
-      NETSTACK_NETWORK.output(&parent);
-    } else if (dmsg.appcat == APP_LGT_ON || dmsg.appcat == APP_IRG_ON) {
-      for (int i = 0; i < nb_children; i++) {
-        nullnet_buf = (uint8_t *)(&dmsg);
-        nullnet_len = sizeof(m_packet_t);
-        NETSTACK_NETWORK.output(&children[i]);
+      if (packet_seen(&dmsg))
+        return;
+#if BATCH_WINDOW > 0
+      // buffer readings and send them upward together
+      if (!(dmsg.flags & PKT_FLAG_SRC))
+        set_packet_src(&dmsg, src);
+      int count = batch_add(&batch, &dmsg);
+      if (count == BATCH_MAX_RECORDS) {
+        ctimer_stop(&batch_timer);
+        flush_batch(NULL);
+      } else if (count == 1) {
+        ctimer_set(&batch_timer, BATCH_WINDOW, flush_batch, NULL);
+      }
+#else
+      trace_forward(&dmsg);
+      send_packet(&dmsg, &parent);
+#endif
+    } else if (dmsg.appcat == APP_LGT_ON) {
+      if (flood_accept(&dmsg, src, &parent)) {
+        int sent = send_packet_down(&dmsg, &children, &parent);
+        LOG_INFO("Command %d sent down in %d frame(s)\n", dmsg.appcat, sent);
+      }
+    } else if (dmsg.appcat == APP_IRG_ON) {
+      if (flood_accept(&dmsg, src, &parent)) {
+        int sent = flood_packet(&dmsg, &children, &parent);
+        LOG_INFO("Command %d sent down in %d frame(s)\n", dmsg.appcat, sent);
+      }
+    } else if (dmsg.appcat == APP_IRG_ACK || dmsg.appcat == APP_TOPO || dmsg.appcat == APP_CMD_ACK
+        || dmsg.appcat == APP_ENERGY) {
+      if (!packet_seen(&dmsg)) {
+        trace_forward(&dmsg);
+        send_packet(&dmsg, &parent);
+      }
+    } else if (dmsg.appcat == APP_STATS) {
+      if (dmsg.flags & PKT_FLAG_PAYLOAD) {
+        // an answer on its way to the gateway
+        if (!packet_seen(&dmsg))
+          send_packet(&dmsg, &parent);
+      } else if (flood_accept(&dmsg, src, &parent)) {
+        flood_packet(&dmsg, &children, &parent);
+        // spread the answers of the whole tree
+        ctimer_set(&stats_timer, random_rand() % STATS_REPLY_JITTER, send_stats_report, NULL);
       }
-    } else if (dmsg.appcat == APP_IRG_ACK) {
-      nullnet_buf = (uint8_t *)(&dmsg);
-      nullnet_len = sizeof(m_packet_t);
-      NETSTACK_NETWORK.output(&parent);
     } else if (dmsg.appcat == APP_MOB_LGT_SEN) {
+      // only requests coming up; our children re-broadcast the answers
+      if (dmsg.value % 2 != 0 || packet_seen(&dmsg))
+        return;
       dmsg.value++;
-      for (int i = 0; i < nb_children; i++) {
-        nullnet_buf = (uint8_t *)(&dmsg);
-        nullnet_len = sizeof(m_packet_t);
-        NETSTACK_NETWORK.output(&children[i]);
-      }
+      set_packet_origin(&dmsg);
+      flood_packet(&dmsg, &children, &parent);
     }
   }
 
   else {
     LOG_INFO("/!\\ Message answer not yet implemented: %d\n", dmsg.msgcat);
+    count_stat(dmsg.msgcat, STAT_UNHANDLED);
   }
 
 }
@@ -176,9 +272,11 @@ PROCESS_THREAD(subgateway_process, ev, data) {
   tsch_set_coordinator(linkaddr_cmp(&coordinator_addr, &linkaddr_node_addr));
 #endif /* MAC_CONF_WITH_TSCH */
 
+  init_commons(rank, &children);
   nullnet_set_input_callback(input_callback);
 
-  ctimer_set(&init_children_alive_timer, CLOCK_SECOND, init_check_children_alive, NULL);
+  ctimer_set(&children_alive_timer, CHILDREN_SWEEP_INTERVAL, check_children_alive, NULL);
+  ctimer_set(&topology_timer, TOPO_REPORT_INTERVAL, send_topology_report, NULL);
 
   update_mote_color(in_net, rank, NO_CAT);
   